@@ -7,12 +7,10 @@ using namespace HTTP;
 
 // -------------------------------------------------------------------
 class CMyServer : public CBaseServer {
-  VBytes star;
   VBytes index;
   VBytes gidx;
 public:
   CMyServer() {
-    star.read("star.png");
     index.read("index.html");
   }
   bool onClientRequest(const TRequest& r) override {
@@ -26,7 +24,7 @@ public:
       content_type = "text/html";
       // Let http compress our answer 
       compressAndSendAnswer( r, *ans, content_type );
-      return false;
+      return true;
     }
     else if (r.url == "/gidx") {
       // gzip compression (static using gzip cmd line)
@@ -34,15 +32,32 @@ public:
       content_type = "text/html";
       content_encoding = "gzip";
     }
+    else if (r.path == "/hello") {
+      // Built in the scratch memory of the request, nothing to free
+      TArenaBytes text(r.arena);
+      TStringView name = r.getURIParam("name");
+      text.format("Hello %.*s\n", (int)name.size, name.data);
+      sendAnswer( r, text.data(), text.size(), "text/plain" );
+      return true;
+    }
+    else if (r.path == "/old") {
+      // Any status and headers
+      TResponse moved;
+      moved.status = 301;
+      moved.addHeader("Location", "/");
+      sendResponse( r, moved );
+      return true;
+    }
     else {
-      // No compression...
-      ans = &star;
-      content_type = "image/png";
+      // No compression. Served from the files cache
+      sendCachedFileAnswer( r, "star.png", "image/png" );
+      return true;
     }
 
     sendAnswer( r, *ans, content_type, content_encoding );
 
-    return false;
+    // Keep the connection open for more requests
+    return true;
   }
 
 };
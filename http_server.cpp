@@ -3,18 +3,82 @@
 #include <cassert>
 #include <algorithm>
 #include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <chrono>
 #include "http_server.h"
 
+#if defined( _WIN32 )
+#define strcasecmp  _stricmp
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+#include <sys/uio.h>
+#endif
+
+#if HTTP_HAS_IO_URING
+#include <linux/io_uring.h>
+// Headers older than linux 6.0 lack the multishot requests we use
+#if !defined( IORING_RECV_MULTISHOT ) || !defined( IORING_ACCEPT_MULTISHOT )
+#undef HTTP_HAS_IO_URING
+#endif
+#endif
+
+#if HTTP_HAS_IO_URING
+#include <cstdint>
+#include <deque>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <poll.h>
+#endif
+
+#if HTTP_HAS_EPOLL
+#include <sys/eventfd.h>
+#endif
+
+// SSE2 is always there in x86-64. AVX2 is chosen at runtime
+#if defined( __SSE2__ ) || defined( _M_X64 )
+#define HTTP_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+#if HTTP_HAS_SSE2 && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#define HTTP_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined( _WIN32 )
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+#if defined( __linux__ )
+#include <sys/sendfile.h>
+#endif
+
 // -------------------------------------------------------------------
 // Enable compression by embedding the miniz.c source code here
 // This reduces the file size by 100Kb.
 // Define DISABLE_MINIZ_SUPPORT to fully discard it
 #if DISABLE_MINIZ_SUPPORT
 
-bool compress( const HTTP::VBytes &src, HTTP::VBytes &dst ) {
+bool compress( const HTTP::VBytes &src, HTTP::VBytes &dst, int level ) {
+  return false;
+}
+
+bool compressGzip( const HTTP::VBytes &src, HTTP::VBytes &dst, int level ) {
   return false;
 }
 
+struct TCompressStream {
+  bool begin( bool new_gzip, int level, HTTP::VBytes &out ) { return false; }
+  bool feed( const char* data, size_t size, bool finish, HTTP::VBytes &out ) { return false; }
+};
+
 #else
 
 #pragma clang diagnostic push
@@ -27,14 +91,93 @@ bool compress( const HTTP::VBytes &src, HTTP::VBytes &dst ) {
 
 #pragma clang diagnostic pop
 
-bool compress( const HTTP::VBytes &src, HTTP::VBytes &dst ) {
-  auto dst_sz = ::compressBound((mz_ulong)src.size());
-  dst.resize( dst_sz );
-  auto cmp_status = ::compress((unsigned char*) dst.data(), &dst_sz, (unsigned char*) src.data(),  (mz_ulong) src.size());
-  if (cmp_status != Z_OK) 
-    return false;
-  dst.resize( dst_sz );
-  return true;
+// tdefl_compressor takes ~300Kb, so each thread keeps one and reuses it
+static tdefl_compressor* threadCompressor() {
+  struct THolder {
+    tdefl_compressor* comp = nullptr;
+    ~THolder() { free( comp ); }
+  };
+  static thread_local THolder holder;
+  if( !holder.comp )
+    holder.comp = (tdefl_compressor*)malloc( sizeof( tdefl_compressor ) );
+  return holder.comp;
+}
+
+// Compresses the input in pieces, so the output can be sent while the
+// rest is still being compressed. zlib framing comes from tdefl, gzip
+// gets a 10 bytes header, and the crc32 and size of the input at the end
+struct TCompressStream {
+  tdefl_compressor* comp = nullptr;
+  bool     gzip = false;
+  mz_ulong crc = MZ_CRC32_INIT;
+  uint32_t total = 0;
+
+  // level goes from 1 (fastest) to 9 (smallest)
+  bool begin( bool new_gzip, int level, HTTP::VBytes &out ) {
+    comp = threadCompressor();
+    if( !comp )
+      return false;
+    gzip = new_gzip;
+    int window_bits = gzip ? -MZ_DEFAULT_WINDOW_BITS : MZ_DEFAULT_WINDOW_BITS;
+    mz_uint flags = tdefl_create_comp_flags_from_zip_params( level, window_bits, MZ_DEFAULT_STRATEGY );
+    if( tdefl_init( comp, nullptr, nullptr, (int)flags ) != TDEFL_STATUS_OKAY )
+      return false;
+    if( gzip ) {
+      static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+      out.insert( out.end(), header, header + sizeof( header ) );
+    }
+    return true;
+  }
+
+  // Appends to out what tdefl produces. Set finish in the last piece
+  bool feed( const char* data, size_t size, bool finish, HTTP::VBytes &out ) {
+    if( gzip ) {
+      crc = mz_crc32( crc, (const unsigned char*)data, size );
+      total += (uint32_t)size;
+    }
+    while( true ) {
+      size_t in_size = size;
+      size_t room = std::max< size_t >( size / 2, 16 * 1024 );
+      size_t used = out.size();
+      out.resize( used + room );
+      size_t out_size = room;
+      tdefl_status status = tdefl_compress( comp, data, &in_size, out.data() + used, &out_size, finish ? TDEFL_FINISH : TDEFL_NO_FLUSH );
+      out.resize( used + out_size );
+      if( status < 0 )
+        return false;
+      data += in_size;
+      size -= in_size;
+      if( status == TDEFL_STATUS_DONE )
+        break;
+      // Without room left, tdefl may still have output pending
+      if( !finish && !size && out_size < room )
+        break;
+    }
+    if( finish && gzip ) {
+      uint32_t trailer[2] = { (uint32_t)crc, total };
+      for( int i = 0; i < 2; ++i ) {
+        for( int k = 0; k < 4; ++k )
+          out.push_back( (char)( trailer[i] >> ( 8 * k ) ) );     // Little endian
+      }
+    }
+    return true;
+  }
+};
+
+static bool compressAll( const HTTP::VBytes &src, HTTP::VBytes &dst, bool gzip, int level ) {
+  TCompressStream z;
+  dst.clear();
+  dst.reserve( ::compressBound( (mz_ulong)src.size() ) + 18 );
+  return z.begin( gzip, level, dst ) && z.feed( src.data(), src.size(), true, dst );
+}
+
+// zlib format, as HTTP expects for 'deflate'
+bool compress( const HTTP::VBytes &src, HTTP::VBytes &dst, int level ) {
+  return compressAll( src, dst, false, level );
+}
+
+bool compressGzip( const HTTP::VBytes &src, HTTP::VBytes &dst, int level ) {
+  return compressAll( src, dst, true, level );
 }
 
 #endif
@@ -48,28 +191,273 @@ namespace HTTP {
     return nbytes_sent == size();
   }
 
+  // -------------------------------------------------------
+  // Header and body go out in a single scatter-gather write, so there is
+  // no copy of the body and Nagle does not hold back the second part
+#if !defined( _WIN32 )
+  static int pendingParts(iovec* iov, const char* header, size_t header_size, const char* body, size_t body_size, size_t sent) {
+    int n = 0;
+    if (sent < header_size) {
+      iov[n].iov_base = (void*)(header + sent);
+      iov[n].iov_len = header_size - sent;
+      ++n;
+      sent = 0;
+    }
+    else
+      sent -= header_size;
+    if (sent < body_size) {
+      iov[n].iov_base = (void*)(body + sent);
+      iov[n].iov_len = body_size - sent;
+      ++n;
+    }
+    return n;
+  }
+#endif
+
+  // Sockets are non blocking, so it stops when the kernel buffer is full.
+  // sent is updated with the progress. Returns false on errors
+  static bool sendParts(TSocket fd, const char* header, size_t header_size, const char* body, size_t body_size, size_t& sent) {
+#if defined( _WIN32 )
+    while (true) {
+      WSABUF bufs[2];
+      DWORD nbufs = 0;
+      size_t skip = sent;
+      const char* parts[2] = { header, body };
+      size_t sizes[2] = { header_size, body_size };
+      for (int i = 0; i < 2; ++i) {
+        if (skip >= sizes[i]) {
+          skip -= sizes[i];
+          continue;
+        }
+        bufs[nbufs].buf = (CHAR*)parts[i] + skip;
+        bufs[nbufs].len = (ULONG)(sizes[i] - skip);
+        nbufs++;
+        skip = 0;
+      }
+      if (!nbufs)
+        return true;
+      DWORD nbytes_sent = 0;
+      if (WSASend(fd, bufs, nbufs, &nbytes_sent, 0, nullptr, nullptr) != 0)
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+      sent += nbytes_sent;
+    }
+#else
+    while (true) {
+      iovec iov[2];
+      msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = pendingParts(iov, header, header_size, body, body_size, sent);
+      if (!msg.msg_iovlen)
+        return true;
+#if defined( MSG_NOSIGNAL )
+      auto nbytes_sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+      auto nbytes_sent = ::sendmsg(fd, &msg, 0);
+#endif
+      if (nbytes_sent > 0)
+        sent += nbytes_sent;
+      else if (nbytes_sent < 0 && errno == EINTR)
+        continue;
+      else
+        return nbytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+#endif
+  }
+
+  static bool sendParts(TSocket fd, const VBytes& header, const VBytes& body, size_t& sent) {
+    return sendParts(fd, header.data(), header.size(), body.data(), body.size(), sent);
+  }
+
+  // Leaves the buffer empty and returns true when a non blocking socket
+  // has nothing to read
   bool VBytes::recv(TSocket fd) {
     resize(capacity());
     auto nbytes_read = ::recv(fd, data(), (int)size(), 0);
-    if (nbytes_read > 0)
+    if (nbytes_read > 0) {
       resize(nbytes_read);
-    return nbytes_read > 0;
+      return true;
+    }
+    resize(0);
+#if defined( _WIN32 )
+    return nbytes_read < 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return nbytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+  }
+
+  // -------------------------------------------------------
+  // Each thread keeps the buffers it is done with (headers, pending
+  // input, queued output) and takes them again instead of going back
+  // to malloc. The big ones are freed
+  static const size_t pooled_buffer_size = 4 * 1024;
+  static const size_t max_pooled_buffer_size = 64 * 1024;
+  static const size_t max_pooled_buffers = 64;
+
+  static std::vector<VBytes>& pooledBuffers() {
+    static thread_local std::vector<VBytes> buffers;
+    return buffers;
+  }
+
+  // Leaves buf empty, with room for pooled_buffer_size bytes at least
+  static void takeBuffer(VBytes& buf) {
+    buf.clear();
+    if (buf.capacity() >= pooled_buffer_size)
+      return;
+    auto& pool = pooledBuffers();
+    if (pool.empty()) {
+      buf.reserve(pooled_buffer_size);
+      return;
+    }
+    buf.swap(pool.back());
+    pool.pop_back();
+  }
+
+  // Leaves buf empty and without memory
+  static void giveBuffer(VBytes& buf) {
+    auto& pool = pooledBuffers();
+    size_t capacity = buf.capacity();
+    if (capacity >= pooled_buffer_size && capacity <= max_pooled_buffer_size && pool.size() < max_pooled_buffers) {
+      if (!pool.capacity())
+        pool.reserve(max_pooled_buffers);
+      buf.clear();
+      pool.emplace_back();
+      pool.back().swap(buf);
+    }
+    VBytes().swap(buf);
+  }
+
+  // A buffer from the pool, given back when it goes out of scope
+  struct TPooledBytes : public VBytes {
+    TPooledBytes() { takeBuffer(*this); }
+    ~TPooledBytes() { giveBuffer(*this); }
+  };
+
+  // -------------------------------------------------------
+  static bool setNonBlocking(TSocket s) {
+#if defined( _WIN32 )
+    u_long on = 1;
+    return ioctlsocket(s, FIONBIO, &on) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+  }
+
+  static void shutdownSocket(TSocket s) {
+#if defined( _WIN32 )
+    ::shutdown(s, SD_BOTH);
+#else
+    ::shutdown(s, SHUT_RDWR);
+#endif
+  }
+
+  // -------------------------------------------------------
+  static int openFile(const char* filename) {
+#if defined( _WIN32 )
+    return _open(filename, _O_RDONLY | _O_BINARY);
+#else
+    return ::open(filename, O_RDONLY | O_CLOEXEC);
+#endif
+  }
+
+  static int dupFile(int fd) {
+#if defined( _WIN32 )
+    return _dup(fd);
+#else
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#endif
+  }
+
+  static void closeFile(int fd) {
+#if defined( _WIN32 )
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+  }
+
+  static bool getFileSize(int fd, uint64_t& size, time_t* mtime = nullptr) {
+#if defined( _WIN32 )
+    struct _stat64 st;
+    if (_fstat64(fd, &st) != 0)
+      return false;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      return false;
+#endif
+    size = (uint64_t)st.st_size;
+    if (mtime)
+      *mtime = st.st_mtime;
+    return true;
+  }
+
+  static long readFileAt(int fd, uint64_t offset, char* buf, size_t size) {
+#if defined( _WIN32 )
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+      return -1;
+    return _read(fd, buf, (unsigned)size);
+#else
+    return (long)::pread(fd, buf, size, (off_t)offset);
+#endif
+  }
+
+  // Sends the range of the file without copying it to user space where
+  // sendfile is available. Like sendParts, offset and size are updated
+  // with the progress, and it returns false on errors
+  static bool sendFilePart(TSocket s, int fd, uint64_t& offset, uint64_t& size) {
+    while (size) {
+#if defined( __linux__ )
+      off_t off = (off_t)offset;
+      auto nbytes_sent = ::sendfile(s, fd, &off, (size_t)std::min<uint64_t>(size, 1 << 30));
+      if (nbytes_sent < 0 && errno == EINTR)
+        continue;
+      if (nbytes_sent == 0)
+        return false;         // The file is shorter than expected
+      if (nbytes_sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#elif defined( __APPLE__ )
+      off_t len = (off_t)std::min<uint64_t>(size, 1 << 30);
+      int rc = ::sendfile(fd, s, (off_t)offset, &len, nullptr, 0);
+      auto nbytes_sent = len;
+      if (rc < 0 && nbytes_sent == 0) {
+        if (errno == EINTR)
+          continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if (rc == 0 && nbytes_sent == 0)
+        return false;
+#else
+      char buf[16 * 1024];
+      long nbytes_read = readFileAt(fd, offset, buf, (size_t)std::min<uint64_t>(size, sizeof(buf)));
+      if (nbytes_read <= 0)
+        return false;
+      size_t nbytes_sent = 0;
+      if (!sendParts(s, buf, (size_t)nbytes_read, nullptr, 0, nbytes_sent))
+        return false;
+      if (!nbytes_sent)
+        return true;
+#endif
+      offset += nbytes_sent;
+      size -= nbytes_sent;
+    }
+    return true;
   }
 
   void VBytes::format(const char* fmt, ...) {
     va_list argp;
     va_start(argp, fmt);
+    // A va_list can't be walked twice, so the retry gets a copy
+    va_list again;
+    va_copy(again, argp);
     resize(512);
-    while (true) {
-      int n = vsnprintf(data(), size(), fmt, argp);   // Copies N characters // vsnprintf_s could be used, has the same behavior and interrupts the program
-      if (n >= size()) {
-        resize(n + 1);
-      }
-      else {
-        resize(n);
-        break;
-      }
+    int n = vsnprintf(data(), size(), fmt, argp);   // Copies N characters // vsnprintf_s could be used, has the same behavior and interrupts the program
+    if (n >= (int)size()) {
+      resize(n + 1);
+      vsnprintf(data(), size(), fmt, again);
     }
+    resize(std::max(n, 0));
+    va_end(again);
     va_end(argp);
   }
 
@@ -87,282 +475,3636 @@ namespace HTTP {
   }
 
   // -------------------------------------------------------
-  void CBaseServer::VSockets::remove(TSocket s) {
-    ::closesocket(s);
-    auto it = std::find(begin(), end(), s);
-    assert(it != end());
-    erase(it);
+  static uint32_t nowInSecs() {
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch());
+    return (uint32_t)secs.count();
   }
 
-  // -------------------------------------------------------
-  bool CBaseServer::TRequest::headerContains(const char* title, const char* text_in_header) const {
-    auto h = getHeader(title);
-    if (!h) return false;
-    auto p = strstr(h, text_in_header);
-    return p != nullptr;
+  // Fills the size, modification time and inode of a regular file
+  static bool statFile(const char* filename, CFileCache::TFile& info) {
+#if defined( _WIN32 )
+    struct _stat64 st;
+    if (_stat64(filename, &st) != 0 || !(st.st_mode & _S_IFREG))
+      return false;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+      return false;
+#endif
+    info.size = (size_t)st.st_size;
+    info.mtime = st.st_mtime;
+    info.inode = (uint64_t)st.st_ino;
+    return true;
   }
 
-  std::string CBaseServer::TRequest::getURIParam(const char* title) const {
-    std::string::size_type start = url.find(title);
-    if( start == std::string::npos )
-      return std::string{};
-    std::string::size_type equal = url.find('=', start);
-    if( equal == std::string::npos )
-      return std::string{};
-    equal++;
-    std::string::size_type end = url.find('&', equal);
-    if( end == std::string::npos )
-      end = url.size();
-    return url.substr(equal, end - equal);
-  } 
+  static bool loadFile(const char* filename, CFileCache::TFile& file) {
+    if (!file.size)
+      return true;
+    int fd = openFile(filename);
+    if (fd < 0)
+      return false;
+#if defined( _WIN32 )
+    char* copy = new char[file.size];
+    bool ok = readFileAt(fd, 0, copy, file.size) == (long)file.size;
+    closeFile(fd);
+    if (!ok) {
+      delete[] copy;
+      return false;
+    }
+    file.mapping = copy;
+#else
+    void* mapping = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    closeFile(fd);
+    if (mapping == MAP_FAILED)
+      return false;
+    file.mapping = mapping;
+#endif
+    file.data = (const char*)file.mapping;
+    return true;
+  }
 
-  //   /path/to/doc?id=23&q=str. => ath/to/doc
-  std::string CBaseServer::TRequest::getURLPath() const {
-    std::string::size_type c = url.find('?');
-    if( c == std::string::npos )
-      c = url.size();
-    return url.substr( 0, c );
+  CFileCache::TFile::~TFile() {
+    if (!mapping)
+      return;
+#if defined( _WIN32 )
+    delete[] (char*)mapping;
+#else
+    munmap(mapping, size);
+#endif
   }
 
   // -------------------------------------------------------
-  const char* CBaseServer::TRequest::getHeader( const char* title ) const {
-    for( int i=0; i<nlines; ++i ) {
-      if( strcmp( title, lines[i].title ) == 0 )
-        return lines[i].value;
+  // Not cryptographic. Mixes 8 bytes at a time, to be much cheaper than
+  // compressing them again
+  static uint64_t hashBytes(const char* data, size_t size) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      uint64_t w;
+      memcpy(&w, data + i, 8);
+      h = (h ^ w) * 0xff51afd7ed558ccdull;
+      h ^= h >> 32;
     }
-    return nullptr;
+    uint64_t w = 0;
+    if (size > i)
+      memcpy(&w, data + i, size - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+    return h;
   }
 
   // -------------------------------------------------------
-  bool CBaseServer::TRequest::parse(VBytes& buf, bool trace) {
-
-    method = UNSUPPORTED;
-
-    char* bol = buf.data();               // begin of line
-    const char* eob = bol + buf.size();   // end of buffer
-    while (true) {
-      auto eol = bol;                     // end of line
-      while (!(eol[0] == '\r' && eol[1] == '\n') && (eol < eob))
-        eol++;
-      if (eol == bol || eol >= eob)      // An empty line of end of buffer found
-        break;
-      *eol = 0x00;                        // To make easier to parse using str* funcs
+  CFileCache::TFileRef CFileCache::get(const char* filename) {
+    uint32_t now = nowInSecs();
+    std::string path(filename);
+    TFileRef cached;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(path);
+      if (it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        if (now - it->second->checked_at < check_interval_secs)
+          return it->second->file;
+        cached = it->second->file;
+      }
+    }
 
-      if (strncmp(bol, "GET ", 4) == 0) {
-        method = GET;
-        url = std::string(bol + 4);
-        // Drop the HTTP/1.1
-        auto idx = url.find_last_of(' ');
-        if (idx != std::string::npos)
-          url.resize(idx);
+    // The disk is checked without holding the lock
+    std::shared_ptr<TFile> file = std::make_shared<TFile>();
+    bool found = statFile(filename, *file);
+    if (found && cached && cached->size == file->size && cached->mtime == file->mtime && cached->inode == file->inode) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(path);
+      if (it != entries.end() && it->second->file == cached)
+        it->second->checked_at = now;
+      return cached;
+    }
 
-        if( trace ) printf("request.get: %s\n", url.c_str());
-      }
-      else {
+    if (!found || file->size > max_file_size || !loadFile(filename, *file))
+      file.reset();
+    else
+      file->hash = hashBytes(file->data, file->size);
 
-        // Split header in title and value
-        auto title = bol;
-        auto value = bol;
-        while( *value != ':' && *value != 0x00 ) 
-          ++value;
-        if( *value == ':' ) {
-          *value++ = 0x00;
-          if( *value == ' ' )
-            value++;
-        }
-  
-        if( nlines < max_header_lines ) {
-          auto& h = lines[ nlines ];
-          h.title = title;
-          h.value = value;
-          nlines++;
-        }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end())
+      erase(it->second);
+    if (!file)
+      return nullptr;
+    lru.push_front(TEntry{ path, file, now });
+    entries[path] = lru.begin();
+    bytes += file->size;
+    while (bytes > max_bytes && lru.size() > 1)
+      erase(std::prev(lru.end()));
+    return file;
+  }
 
-        // Other headers
-        if( trace ) printf("request.header: '%s' => '%s'\n", title, value);
-      }
+  void CFileCache::erase(VEntries::iterator it) {
+    bytes -= it->file->size;
+    entries.erase(it->path);
+    lru.erase(it);
+  }
 
-      bol = eol + 2;                      // Skip \r and \n
-    }
-    return !url.empty();
+  void CFileCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lru.clear();
+    bytes = 0;
   }
 
   // -------------------------------------------------------
-  bool CBaseServer::createServer(int port) {
-    server = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (server < 0) {
-      printf( "createServer.socket failed\n");
-      return false;
+  // q-values have 3 decimals at most
+  static int parseQuality(const char* p) {
+    int q = 0;
+    if (*p >= '0' && *p <= '9')
+      q = (*p++ - '0') * 1000;
+    if (*p == '.') {
+      ++p;
+      for (int scale = 100; scale && *p >= '0' && *p <= '9'; scale /= 10)
+        q += (*p++ - '0') * scale;
     }
+    return std::min(q, 1000);
+  }
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-
-    if (bind(server, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-      printf( "createServer.bind failed\n");
-      return false;
+  // The encoding with the highest q-value in Accept-Encoding we can
+  // generate. gzip wins the ties. nullptr when none is accepted
+  static const char* chooseEncoding(const char* accept_encoding) {
+    if (!accept_encoding)
+      return nullptr;
+    int q_gzip = -1;
+    int q_deflate = -1;
+    int q_any = -1;
+    const char* p = accept_encoding;
+    while (*p) {
+      while (*p == ' ' || *p == ',')
+        ++p;
+      const char* name = p;
+      while (*p && *p != ',' && *p != ';' && *p != ' ')
+        ++p;
+      size_t len = p - name;
+      int q = 1000;
+      while (*p && *p != ',') {
+        if (*p == ';') {
+          ++p;
+          while (*p == ' ')
+            ++p;
+          if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+            q = parseQuality(p + 2);
+        }
+        else
+          ++p;
+      }
+      if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0))
+        q_gzip = q;
+      else if (len == 7 && strncasecmp(name, "deflate", 7) == 0)
+        q_deflate = q;
+      else if (len == 1 && *name == '*')
+        q_any = q;
     }
+    if (q_gzip < 0)
+      q_gzip = q_any;
+    if (q_deflate < 0)
+      q_deflate = q_any;
+    if (q_gzip <= 0 && q_deflate <= 0)
+      return nullptr;
+    return q_gzip >= q_deflate ? "gzip" : "deflate";
+  }
 
-    if (listen(server, 5) < 0) {
-      printf( "createServer.listen failed\n");
-      return false;
-    }
+  static bool compressAs(const char* encoding, int level, const VBytes& src, VBytes& dst) {
+    if (strcmp(encoding, "gzip") == 0)
+      return compressGzip(src, dst, level);
+    return compress(src, dst, level);
+  }
 
-    return true;
+  // Entries ending in '/' match the whole family, and parameters like
+  // '; charset=' are ignored because the type only has to start with it
+  static bool matchesType(const char* content_type, const std::string& pattern) {
+    return content_type && strncasecmp(content_type, pattern.c_str(), pattern.size()) == 0;
   }
 
-  // -------------------------------------------------------
-  bool CBaseServer::TActivity::wait(VSockets& sockets, unsigned timeout_usecs) {
+  static std::string compressedKey(TStringView url, const char* encoding, int level) {
+    std::string key(url.data, url.size);
+    key += ' ';
+    key += encoding;
+    key += ' ';
+    key += (char)('0' + level);
+    return key;
+  }
 
-    if( sockets.empty() )
-      return false;
-    
-    FD_ZERO(&fds);
-    auto max_fd = sockets[0];
-    for (auto s : sockets) {
-      if (s > max_fd)
-        max_fd = s;
-      FD_SET(s, &fds);
+  CCompressedCache::TDataRef CCompressedCache::get(TStringView url, const char* encoding, int level, uint64_t hash, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(compressedKey(url, encoding, level));
+    if (it == entries.end() || it->second->hash != hash || it->second->size != size) {
+      misses++;
+      return nullptr;
     }
+    lru.splice(lru.begin(), lru, it->second);
+    hits++;
+    bytes_saved += size;
+    return it->second->data;
+  }
 
-    struct timeval timeout;
-    timeout.tv_sec = timeout_usecs / 1000000;
-    timeout.tv_usec = timeout_usecs % 1000000;
-    auto nready = select((int)max_fd + 1, &fds, NULL, NULL, &timeout);
-    if (nready <= 0)
-      return false;
+  void CCompressedCache::add(TStringView url, const char* encoding, int level, uint64_t hash, size_t size, const TDataRef& data) {
+    std::string key = compressedKey(url, encoding, level);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end())
+      erase(it->second);
+    if (data->size() > max_bytes)
+      return;
+    lru.push_front(TEntry{ key, hash, size, data });
+    entries[key] = lru.begin();
+    bytes += data->size();
+    while (bytes > max_bytes)
+      erase(std::prev(lru.end()));
+  }
 
-    ready_to_read.clear();
-    for (auto s : sockets) {
-      if (FD_ISSET(s, &fds)) {
-        ready_to_read.push_back(s);
-        nready--;
-        if (!nready)
-          break;
-      }
-    }
-    return true;
+  void CCompressedCache::erase(VEntries::iterator it) {
+    bytes -= it->data->size();
+    entries.erase(it->key);
+    lru.erase(it);
   }
 
-  // -------------------------------------------------------
-  TSocket CBaseServer::acceptNewClient() {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    auto client = ::accept(server, (struct sockaddr *)&client_addr, &addr_len);
-    if( trace ) printf("http_server.New client at socket %d\n", (int)client);
-    return client;
+  void CCompressedCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lru.clear();
+    bytes = 0;
   }
 
-  // -------------------------------------------------------
-  void CBaseServer::prepare() {
-    inbuf.reserve(2048);
-    active_sockets.reserve(8);
-    active_sockets.push_back(server);
-    activity.ready_to_read.reserve(8);
+  CCompressedCache::TStats CCompressedCache::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    TStats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.bytes_saved = bytes_saved;
+    stats.bytes = bytes;
+    stats.entries = lru.size();
+    return stats;
   }
 
   // -------------------------------------------------------
-  CBaseServer::~CBaseServer() {
-    close();
+  void CBaseServer::VSockets::remove(TSocket s) {
+    ::closesocket(s);
+    detach(s);
   }
 
-  // -------------------------------------------------------
-  bool CBaseServer::open(int port) {
-    if (!createServer(port))
-      return false;
-    prepare();
-    return true;
+  void CBaseServer::VSockets::detach(TSocket s) {
+    auto it = std::find(begin(), end(), s);
+    assert(it != end());
+    erase(it);
+  }
+
+  // -------------------------------------------------------
+  size_t TStringView::find(char c, size_t from) const {
+    if (from >= size)
+      return npos;
+    auto p = (const char*)memchr(data + from, c, size - from);
+    return p ? (size_t)(p - data) : npos;
+  }
+
+  TStringView TStringView::substr(size_t from, size_t n) const {
+    if (from > size)
+      from = size;
+    return TStringView(data + from, std::min(n, size - from));
+  }
+
+  bool TStringView::startsWith(TStringView prefix) const {
+    return prefix.size <= size && (!prefix.size || memcmp(data, prefix.data, prefix.size) == 0);
+  }
+
+  bool operator==(TStringView a, TStringView b) {
+    return a.size == b.size && (!a.size || memcmp(a.data, b.data, a.size) == 0);
+  }
+
+  // -------------------------------------------------------
+  CArena::~CArena() {
+    for (auto& b : blocks)
+      ::operator delete(b.data);
+  }
+
+  void* CArena::alloc(size_t size, size_t align) {
+    while (current < blocks.size()) {
+      TBlock& b = blocks[current];
+      size_t start = (offset + align - 1) & ~(align - 1);
+      if (start <= b.size && size <= b.size - start) {
+        offset = start + size;
+        return b.data + start;
+      }
+      if (current + 1 == blocks.size())
+        break;
+      used_before += offset;
+      offset = 0;
+      ++current;
+    }
+    // Blocks come aligned for any type
+    TBlock b;
+    b.size = std::max(block_size, size);
+    b.data = (char*)::operator new(b.size);
+    if (!blocks.empty()) {
+      used_before += offset;
+      ++current;
+    }
+    blocks.push_back(b);
+    offset = size;
+    return b.data;
+  }
+
+  void CArena::free(void* p, size_t size) {
+    if (current < blocks.size() && (char*)p + size == blocks[current].data + offset)
+      offset -= size;
+  }
+
+  // The blocks larger than usual are freed
+  void CArena::reset() {
+    size_t n = 0;
+    for (auto& b : blocks) {
+      if (b.size > block_size)
+        ::operator delete(b.data);
+      else
+        blocks[n++] = b;
+    }
+    blocks.resize(n);
+    current = 0;
+    offset = 0;
+    used_before = 0;
+  }
+
+  TArenaBytes& TArenaBytes::format(const char* fmt, ...) {
+    size_t old_size = size();
+    va_list argp;
+    va_start(argp, fmt);
+    va_list again;
+    va_copy(again, argp);
+    resize(old_size + 128);
+    int n = vsnprintf(data() + old_size, 128, fmt, argp);
+    if (n >= 128) {
+      resize(old_size + n + 1);
+      vsnprintf(data() + old_size, n + 1, fmt, again);
+    }
+    va_end(again);
+    va_end(argp);
+    resize(old_size + std::max(n, 0));
+    return *this;
+  }
+
+  // Indexes the query params
+  static uint32_t nameHash(TStringView name) {
+    uint32_t h = 2166136261u;                 // FNV-1a
+    for (char c : name)
+      h = (h ^ (unsigned char)c) * 16777619u;
+    return h;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TRequest::headerContains(const char* title, const char* text_in_header) const {
+    auto h = getHeader(title);
+    if (!h) return false;
+    auto p = strstr(h, text_in_header);
+    return p != nullptr;
+  }
+
+  //   /path/to/doc?id=23&q=a%20b, "q" => a b
+  TStringView CBaseServer::TRequest::getURIParam(const char* title) const {
+    const size_t nslots = sizeof(param_slots) / sizeof(param_slots[0]);
+    TStringView name(title);
+    size_t slot = nameHash(name) & (nslots - 1);
+    while( param_slots[slot] ) {
+      const TParam& param = params[param_slots[slot] - 1];
+      if( param.name == name )
+        return param.value;
+      slot = (slot + 1) & (nslots - 1);
+    }
+    return TStringView();
+  } 
+
+  // -------------------------------------------------------
+  const char* CBaseServer::TRequest::getHeader( const char* title ) const {
+    eHeader id = headerId( title, strlen( title ) );
+    if( id != HEADER_OTHER )
+      return known[id];
+    for( int i=0; i<nlines; ++i ) {
+      if( strcasecmp( title, lines[i].title ) == 0 )
+        return lines[i].value;
+    }
+    return nullptr;
+  }
+
+  // The length and the first letter leave a single candidate to check
+  CBaseServer::TRequest::eHeader CBaseServer::TRequest::headerId( const char* title, size_t len ) {
+    eHeader id = HEADER_OTHER;
+    const char* name = nullptr;
+    char first = (char)( title[0] | 0x20 );     // Lower case for letters
+    switch( len ) {
+    case 4:
+      id = HEADER_HOST; name = "host";
+      break;
+    case 5:
+      id = HEADER_RANGE; name = "range";
+      break;
+    case 6:
+      if( first == 'a' ) { id = HEADER_ACCEPT; name = "accept"; }
+      else if( first == 'c' ) { id = HEADER_COOKIE; name = "cookie"; }
+      else if( first == 'e' ) { id = HEADER_EXPECT; name = "expect"; }
+      break;
+    case 10:
+      if( first == 'c' ) { id = HEADER_CONNECTION; name = "connection"; }
+      else if( first == 'u' ) { id = HEADER_USER_AGENT; name = "user-agent"; }
+      break;
+    case 12:
+      id = HEADER_CONTENT_TYPE; name = "content-type";
+      break;
+    case 13:
+      id = HEADER_IF_NONE_MATCH; name = "if-none-match";
+      break;
+    case 14:
+      id = HEADER_CONTENT_LENGTH; name = "content-length";
+      break;
+    case 15:
+      id = HEADER_ACCEPT_ENCODING; name = "accept-encoding";
+      break;
+    case 16:
+      id = HEADER_CONTENT_ENCODING; name = "content-encoding";
+      break;
+    case 17:
+      if( first == 'i' ) { id = HEADER_IF_MODIFIED_SINCE; name = "if-modified-since"; }
+      else if( first == 't' ) { id = HEADER_TRANSFER_ENCODING; name = "transfer-encoding"; }
+      break;
+    }
+    if( !name || strncasecmp( title, name, len ) != 0 )
+      return HEADER_OTHER;
+    return id;
+  }
+
+  // -------------------------------------------------------
+  // Returns the first a or b in [p, end), or end. The header parser
+  // spends its time here looking for '\r' and ':', so x86 checks 16 or
+  // 32 bytes per step
+  static const char* scanAnyScalar(const char* p, const char* end, char a, char b) {
+    while (p < end && *p != a && *p != b)
+      ++p;
+    return p;
+  }
+
+#if HTTP_HAS_SSE2
+  static inline int firstBit(unsigned mask) {
+#if defined( _MSC_VER )
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return (int)idx;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+
+  static const char* scanAnySSE2(const char* p, const char* end, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+      unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+      if (mask)
+        return p + firstBit(mask);
+      p += 16;
+    }
+    return scanAnyScalar(p, end, a, b);
+  }
+#endif
+
+#if HTTP_HAS_AVX2
+  __attribute__((target("avx2")))
+  static const char* scanAnyAVX2(const char* p, const char* end, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)p);
+      __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+      unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+      if (mask)
+        return p + firstBit(mask);
+      p += 32;
+    }
+    return scanAnySSE2(p, end, a, b);
+  }
+#endif
+
+  typedef const char* (*TScanner)(const char* p, const char* end, char a, char b);
+  static TScanner chooseScanner() {
+#if HTTP_HAS_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return &scanAnyAVX2;
+#endif
+#if HTTP_HAS_SSE2
+    return &scanAnySSE2;
+#else
+    return &scanAnyScalar;
+#endif
+  }
+  static const TScanner scanAny = chooseScanner();
+
+  // -------------------------------------------------------
+  static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  // Text without escapes is returned as it is. Otherwise the runs
+  // between escapes are copied whole to the decoded storage
+  TStringView CBaseServer::TRequest::decode(TStringView text) {
+    const char* p = text.begin();
+    const char* esc = scanAny(p, text.end(), '%', '+');
+    if (esc == text.end())
+      return text;
+
+    // All the decoded params fit in the query, so it never moves
+    if (decoded.capacity() < query.size)
+      decoded.reserve(query.size);
+    size_t start = decoded.size();
+    while (true) {
+      decoded.append(p, esc - p);
+      if (esc == text.end())
+        break;
+      if (*esc == '+') {
+        decoded.push_back(' ');
+        p = esc + 1;
+      }
+      else if (text.end() - esc >= 3 && hexValue(esc[1]) >= 0 && hexValue(esc[2]) >= 0) {
+        decoded.push_back((char)(hexValue(esc[1]) * 16 + hexValue(esc[2])));
+        p = esc + 3;
+      }
+      else {                                  // A bad escape is kept as it is
+        decoded.push_back('%');
+        p = esc + 1;
+      }
+      esc = scanAny(p, text.end(), '%', '+');
+    }
+    return TStringView(decoded.data() + start, decoded.size() - start);
+  }
+
+  // Splits the query in decoded name and value pairs, indexed by name
+  void CBaseServer::TRequest::parseQuery() {
+    const size_t nslots = sizeof(param_slots) / sizeof(param_slots[0]);
+    size_t start = 0;
+    while (start < query.size && nparams < max_query_params) {
+      size_t end = query.find('&', start);
+      if (end == TStringView::npos)
+        end = query.size;
+      TStringView pair = query.substr(start, end - start);
+      start = end + 1;
+      if (pair.empty())
+        continue;
+
+      size_t equal = pair.find('=');
+      TParam& param = params[nparams];
+      param.name = decode(pair.substr(0, equal));
+      param.value = equal == TStringView::npos ? TStringView() : decode(pair.substr(equal + 1));
+
+      // Repeated names keep the first one
+      size_t slot = nameHash(param.name) & (nslots - 1);
+      while (param_slots[slot] && params[param_slots[slot] - 1].name != param.name)
+        slot = (slot + 1) & (nslots - 1);
+      if (!param_slots[slot])
+        param_slots[slot] = (uint8_t)(nparams + 1);
+      nparams++;
+    }
+  }
+
+  // -------------------------------------------------------
+  static CBaseServer::TRequest::eMethod methodFromName(TStringView name) {
+    typedef CBaseServer::TRequest R;
+    static const struct { const char* name; R::eMethod method; } methods[] = {
+      { "GET", R::GET }, { "POST", R::POST }, { "PUT", R::PUT }, { "PATCH", R::PATCH }, { "DELETE", R::DEL }, { "HEAD", R::HEAD },
+    };
+    for (auto& m : methods) {
+      if (name == m.name)
+        return m.method;
+    }
+    return R::UNSUPPORTED;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TRequest::parse(VBytes& buf, bool trace) {
+    return parse(buf.data(), buf.size(), trace);
+  }
+
+  bool CBaseServer::TRequest::parse(char* data, size_t size, bool trace) {
+
+    method = UNSUPPORTED;
+    nlines = 0;
+    url = path = query = TStringView();
+    if (nparams) {
+      nparams = 0;
+      memset(param_slots, 0, sizeof(param_slots));
+    }
+    decoded.clear();
+    version = 11;
+    content_length = 0;
+    chunked = false;
+    body_size = 0;
+    for( auto& k : known )
+      k = nullptr;
+
+    char* bol = data;                     // begin of line
+    const char* eob = data + size;        // end of buffer
+    while (bol < eob) {
+      // The first ':' splits the title from the value. The value may
+      // have more, so only the \r is searched after it
+      auto eol = (char*)scanAny(bol, eob, '\r', ':');         // end of line
+      char* colon = nullptr;
+      if (eol < eob && *eol == ':') {
+        colon = eol;
+        eol = (char*)memchr(colon, '\r', eob - colon);
+      }
+      if (!eol || eol + 1 >= eob || eol[1] != '\n')
+        break;
+      if (eol == bol)                     // An empty line found
+        break;
+      *eol = 0x00;                        // To make easier to parse using str* funcs
+
+      if (bol == data) {
+        // GET /index.html HTTP/1.1
+        auto url_begin = (char*)memchr(bol, ' ', eol - bol);
+        method = url_begin ? methodFromName(TStringView(bol, url_begin - bol)) : UNSUPPORTED;
+        if (method != UNSUPPORTED) {
+          ++url_begin;
+          // Drop the HTTP/1.1
+          char* url_end = eol;
+          char* space = eol;
+          while (space > url_begin && space[-1] != ' ')
+            --space;
+          if (space > url_begin) {
+            if (strcmp(space, "HTTP/1.0") == 0)
+              version = 10;
+            url_end = space - 1;
+            *url_end = 0x00;
+          }
+          url = TStringView(url_begin, url_end - url_begin);
+          size_t question = url.find('?');
+          path = url.substr(0, question);
+          if (question != TStringView::npos) {
+            query = url.substr(question + 1);
+            parseQuery();
+          }
+        }
+
+        if( trace ) printf("request: %s\n", bol);
+      }
+      else {
+
+        // Split header in title and value
+        auto title = bol;
+        auto value = eol;
+        if( colon ) {
+          *colon = 0x00;
+          value = colon + 1;
+          if( *value == ' ' )
+            value++;
+        }
+  
+        if( nlines < max_header_lines ) {
+          auto& h = lines[ nlines ];
+          h.title = title;
+          h.value = value;
+          nlines++;
+        }
+
+        if( colon ) {
+          eHeader id = headerId( title, colon - title );
+          if( id != HEADER_OTHER && !known[id] )
+            known[id] = value;
+        }
+
+        // Other headers
+        if( trace ) printf("request.header: '%s' => '%s'\n", title, value);
+      }
+
+      bol = eol + 2;                      // Skip \r and \n
+    }
+
+    const char* connection = known[HEADER_CONNECTION];
+    if (version == 10)
+      keep_alive = connection && strcasecmp(connection, "keep-alive") == 0;
+    else
+      keep_alive = !connection || strcasecmp(connection, "close") != 0;
+
+    // Chunked must be the last transfer coding, and wins over the length
+    bool bad_body = false;
+    if (const char* coding = known[HEADER_TRANSFER_ENCODING]) {
+      size_t len = strlen(coding);
+      chunked = len >= 7 && strcasecmp(coding + len - 7, "chunked") == 0;
+      bad_body = !chunked;
+    }
+    else if (const char* length = known[HEADER_CONTENT_LENGTH]) {
+      bad_body = !*length;
+      for (const char* p = length; *p && !bad_body; ++p) {
+        bad_body = *p < '0' || *p > '9' || content_length > UINT64_MAX / 10 - 1;
+        content_length = content_length * 10 + (*p - '0');
+      }
+    }
+
+    // Without knowing where the body ends, the next request can't be found
+    if (url.empty() || bad_body) {
+      if (bad_body || hasBody())
+        keep_alive = false;
+      return false;
+    }
+    return true;
+  }
+
+  // -------------------------------------------------------
+  // Returns the offset just after the empty line ending the request
+  // header, or 0 if it has not arrived yet. The search starts at 'from'
+  // but still finds a terminator split by a previous search
+  static size_t findEndOfRequest(const char* data, size_t from, size_t size) {
+    const char* p = data + from;
+    const char* eob = data + size;
+    while (p < eob) {
+      p = (const char*)memchr(p, '\n', eob - p);
+      if (!p)
+        return 0;
+      if (p - data >= 3 && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r')
+        return (p - data) + 1;
+      ++p;
+    }
+    return 0;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::createServer(int port, bool reuse_port) {
+    server = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) {
+      printf( "createServer.socket failed\n");
+      return false;
+    }
+
+    int on = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#if defined( SO_REUSEPORT )
+    // Each reactor binds its own socket to the same port, and the kernel
+    // balances the new connections between them
+    if (reuse_port && setsockopt(server, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) < 0) {
+      printf( "createServer.SO_REUSEPORT failed\n");
+      return false;
+    }
+#endif
+
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    if (bind(server, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+      printf( "createServer.bind failed\n");
+      return false;
+    }
+
+    if (listen(server, SOMAXCONN) < 0) {
+      printf( "createServer.listen failed\n");
+      return false;
+    }
+
+    // So accept does not block if the client is gone before we get it
+    setNonBlocking(server);
+
+    return true;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TActivity::open(bool new_use_epoll) {
+    use_epoll = false;
+#if HTTP_HAS_EPOLL
+    if (new_use_epoll) {
+      epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      if (epoll_fd < 0) {
+        printf("activity.epoll_create1 failed. Using select\n");
+        return true;
+      }
+      events.resize(256);
+      use_epoll = true;
+    }
+#endif
+    return true;
+  }
+
+  void CBaseServer::TActivity::close() {
+#if HTTP_HAS_EPOLL
+    if (epoll_fd >= 0)
+      ::close(epoll_fd);
+    epoll_fd = -1;
+#endif
+    use_epoll = false;
+  }
+
+  // Returns false if the socket can't be watched
+  bool CBaseServer::TActivity::add(TSocket s) {
+#if HTTP_HAS_EPOLL
+    if (use_epoll) {
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = s;
+      return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) == 0;
+    }
+#endif
+#if !defined( _WIN32 )
+    // FD_SET can't store sockets beyond this limit
+    if (s >= FD_SETSIZE)
+      return false;
+#endif
+    return true;
+  }
+
+  void CBaseServer::TActivity::remove(TSocket s) {
+#if HTTP_HAS_EPOLL
+    if (use_epoll) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+      return;
+    }
+#endif
+    auto it = std::find(writers.begin(), writers.end(), s);
+    if (it != writers.end())
+      writers.erase(it);
+    it = std::find(paused.begin(), paused.end(), s);
+    if (it != paused.end())
+      paused.erase(it);
+  }
+
+  static void setMember(std::vector<TSocket>& sockets, TSocket s, bool on) {
+    auto it = std::find(sockets.begin(), sockets.end(), s);
+    if (on && it == sockets.end())
+      sockets.push_back(s);
+    else if (!on && it != sockets.end())
+      sockets.erase(it);
+  }
+
+  // While writing, the socket is not read
+  void CBaseServer::TActivity::watch(TSocket s, bool read, bool write) {
+#if HTTP_HAS_EPOLL
+    if (use_epoll) {
+      epoll_event ev;
+      ev.events = 0;
+      if (write)
+        ev.events = EPOLLOUT;
+      else if (read)
+        ev.events = EPOLLIN;
+      ev.data.fd = s;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev);
+      return;
+    }
+#endif
+    setMember(writers, s, write);
+    setMember(paused, s, !read);
+  }
+
+  bool CBaseServer::TActivity::wait(VSockets& sockets, unsigned timeout_usecs) {
+
+    if( sockets.empty() )
+      return false;
+
+#if HTTP_HAS_EPOLL
+    if (use_epoll) {
+      // Round up, so we don't spin when asked to wait less than 1ms
+      int timeout_msecs = (int)((timeout_usecs + 999) / 1000);
+      auto nready = epoll_wait(epoll_fd, events.data(), (int)events.size(), timeout_msecs);
+      if (nready <= 0)
+        return false;
+      ready_to_read.clear();
+      ready_to_write.clear();
+      for (int i = 0; i < nready; ++i) {
+        if (events[i].events & EPOLLOUT)
+          ready_to_write.push_back(events[i].data.fd);
+        else
+          ready_to_read.push_back(events[i].data.fd);
+      }
+      return true;
+    }
+#endif
+    
+    FD_ZERO(&fds);
+    FD_ZERO(&write_fds);
+    auto max_fd = sockets[0];
+    for (auto s : sockets) {
+      if (s > max_fd)
+        max_fd = s;
+      FD_SET(s, &fds);
+    }
+    for (auto s : paused)
+      FD_CLR(s, &fds);
+    for (auto s : writers) {
+      FD_CLR(s, &fds);
+      FD_SET(s, &write_fds);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_usecs / 1000000;
+    timeout.tv_usec = timeout_usecs % 1000000;
+    auto nready = select((int)max_fd + 1, &fds, writers.empty() ? NULL : &write_fds, NULL, &timeout);
+    if (nready <= 0)
+      return false;
+
+    ready_to_read.clear();
+    ready_to_write.clear();
+    for (auto s : writers) {
+      if (FD_ISSET(s, &write_fds)) {
+        ready_to_write.push_back(s);
+        nready--;
+      }
+    }
+    for (auto s : sockets) {
+      if (!nready)
+        break;
+      if (FD_ISSET(s, &fds)) {
+        ready_to_read.push_back(s);
+        nready--;
+      }
+    }
+    return true;
+  }
+
+#if HTTP_HAS_IO_URING
+
+  // -------------------------------------------------------
+  // Accepts and reads are multishot requests, armed once per socket.
+  // Received data lands in a group of buffers we provide to the kernel.
+  // Answers are sent with a header+body sendmsg, one answer in flight
+  // per socket to keep them in order. Everything requested during a tick
+  // is submitted with a single io_uring_enter at the end of the tick
+  struct CBaseServer::TURing {
+
+    enum eTag { TAG_ACCEPT = 1, TAG_RECV = 2, TAG_SEND = 3, TAG_CANCEL = 4, TAG_BUFFERS = 5, TAG_WAKE = 6, TAG_MASK = 7 };
+
+    static const unsigned num_entries = 256;
+    static const unsigned num_buffers = 128;
+    static const unsigned buffer_size = 4096;
+    static const unsigned buffer_group = 0;
+
+    // The kernel reads msg while the send is in flight, so they are
+    // kept in a deque, which does not move them when growing
+    struct TSend {
+      TSocket  fd;
+      VBytes   parts[2];            // header & body
+      const char* body = nullptr;   // parts[1] or the shared bytes
+      size_t   body_size = 0;
+      std::shared_ptr<const void> keep;   // Owner of the shared bytes
+      int      file = -1;           // The rest of a file range, read in pieces
+      uint64_t offset = 0;
+      uint64_t left = 0;
+      size_t   sent;
+      msghdr   msg;
+      iovec    iov[2];
+      bool     pending;     // Waiting for the completion
+    };
+
+    // Files are read in pieces of this size as the previous one is sent
+    static const size_t file_piece_size = 256 * 1024;
+
+    struct TSlot {
+      uint32_t         gen = 0;
+      bool             recv_armed = false;
+      bool             closing = false;
+      bool             paused = false;    // Not read while a worker has its request
+      bool             failed = false;    // A send failed. The answers queued are dropped
+      std::vector<int> sends;           // Queued in order. The first one is in flight
+    };
+
+    TReactor*          reactor = nullptr;
+    int                ring_fd = -1;
+
+    // Submission & completion rings, shared with the kernel
+    void*              ring_ptr = MAP_FAILED;
+    size_t             ring_size = 0;
+    io_uring_sqe*      sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t             sqes_size = 0;
+    unsigned*          sq_head;
+    unsigned*          sq_tail;
+    unsigned*          sq_array;
+    unsigned           sq_mask;
+    unsigned           sq_entries;
+    unsigned           sq_local_tail = 0;
+    unsigned           sq_submitted = 0;
+    unsigned*          cq_head;
+    unsigned*          cq_tail;
+    unsigned           cq_mask;
+    io_uring_cqe*      cqes;
+
+    // Provided buffers for recv. Returned to the kernel at the end of each tick
+    std::vector<char>  buffers;
+    std::vector<int>   buffers_to_recycle;
+
+    std::vector<TSlot> slots;           // Indexed by socket
+    std::deque<TSend>  sends;
+    std::vector<int>   free_sends;
+
+    static bool kernelSupported() {
+      // Multishot recv was added in 6.0. Older kernels accept the
+      // request, but never deliver data
+      struct utsname u;
+      if (uname(&u) != 0)
+        return false;
+      int major = 0, minor = 0;
+      if (sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return false;
+      return major >= 6;
+    }
+
+    bool open(TReactor* new_reactor) {
+      reactor = new_reactor;
+      if (!kernelSupported())
+        return false;
+
+      io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      ring_fd = (int)syscall(__NR_io_uring_setup, num_entries, &p);
+      if (ring_fd < 0)
+        return false;
+      const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+      if ((p.features & required) != required)
+        return false;
+
+      size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      ring_size = std::max(sq_size, cq_size);
+      ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+      if (ring_ptr == MAP_FAILED)
+        return false;
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+      if (sqes == MAP_FAILED)
+        return false;
+
+      char* base = (char*)ring_ptr;
+      sq_head = (unsigned*)(base + p.sq_off.head);
+      sq_tail = (unsigned*)(base + p.sq_off.tail);
+      sq_array = (unsigned*)(base + p.sq_off.array);
+      sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+      sq_entries = p.sq_entries;
+      sq_local_tail = sq_submitted = *sq_tail;
+      cq_head = (unsigned*)(base + p.cq_off.head);
+      cq_tail = (unsigned*)(base + p.cq_off.tail);
+      cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+      cqes = (io_uring_cqe*)(base + p.cq_off.cqes);
+
+      buffers.resize(num_buffers * buffer_size);
+      if (!provideBuffers(0, num_buffers))
+        return false;
+
+      if (reactor->wake_fds[0] != INVALID_SOCKET && !armWake())
+        return false;
+      return armAccept();
+    }
+
+    void close() {
+      if (ring_fd >= 0)
+        ::close(ring_fd);
+      ring_fd = -1;
+      if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+      if (ring_ptr != MAP_FAILED)
+        munmap(ring_ptr, ring_size);
+      sqes = (io_uring_sqe*)MAP_FAILED;
+      ring_ptr = MAP_FAILED;
+    }
+
+    // -------------------------------------------------------
+    TSlot& slot(TSocket s) {
+      if ((size_t)s >= slots.size())
+        slots.resize(s + 1);
+      return slots[s];
+    }
+
+    uint64_t socketUserData(eTag tag, TSocket s) {
+      return ((uint64_t)s << 32) | ((uint64_t)(slot(s).gen & 0x1fffffff) << 3) | tag;
+    }
+
+    bool hasRoom(unsigned n) {
+      if (sq_local_tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) <= sq_entries)
+        return true;
+      // Full. Submit what we have to make room
+      enter(0, 0);
+      return sq_local_tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) <= sq_entries;
+    }
+
+    io_uring_sqe* getSqe() {
+      if (!hasRoom(1))
+        return nullptr;
+      unsigned idx = sq_local_tail & sq_mask;
+      io_uring_sqe* sqe = &sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sq_array[idx] = idx;
+      sq_local_tail++;
+      return sqe;
+    }
+
+    // Submits the pending requests and waits up to timeout_usecs for min_complete completions
+    int enter(unsigned min_complete, unsigned timeout_usecs) {
+      unsigned to_submit = sq_local_tail - sq_submitted;
+      __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+      sq_submitted = sq_local_tail;
+      if (!min_complete) {
+        if (!to_submit)
+          return 0;
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+      }
+      __kernel_timespec ts;
+      ts.tv_sec = timeout_usecs / 1000000;
+      ts.tv_nsec = (timeout_usecs % 1000000) * 1000;
+      io_uring_getevents_arg arg;
+      memset(&arg, 0, sizeof(arg));
+      arg.ts = (uint64_t)&ts;
+      unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+    }
+
+    bool provideBuffers(int first_bid, int count) {
+      io_uring_sqe* sqe = getSqe();
+      if (!sqe)
+        return false;
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = count;
+      sqe->addr = (uint64_t)(buffers.data() + first_bid * buffer_size);
+      sqe->len = buffer_size;
+      sqe->off = first_bid;
+      sqe->buf_group = buffer_group;
+      sqe->user_data = TAG_BUFFERS;
+      return true;
+    }
+
+    // Consecutive buffers are returned with a single request
+    void recycleBuffers() {
+      std::sort(buffers_to_recycle.begin(), buffers_to_recycle.end());
+      size_t i = 0;
+      while (i < buffers_to_recycle.size()) {
+        size_t j = i + 1;
+        while (j < buffers_to_recycle.size() && buffers_to_recycle[j] == buffers_to_recycle[j - 1] + 1)
+          ++j;
+        if (!provideBuffers(buffers_to_recycle[i], (int)(j - i)))
+          break;
+        i = j;
+      }
+      buffers_to_recycle.erase(buffers_to_recycle.begin(), buffers_to_recycle.begin() + i);
+    }
+
+    // -------------------------------------------------------
+    bool armAccept() {
+      io_uring_sqe* sqe = getSqe();
+      if (!sqe)
+        return false;
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = reactor->server;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_CLOEXEC;
+      sqe->user_data = TAG_ACCEPT;
+      return true;
+    }
+
+    // The workers wake us up writing to this fd
+    bool armWake() {
+      io_uring_sqe* sqe = getSqe();
+      if (!sqe)
+        return false;
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = reactor->wake_fds[0];
+      sqe->poll32_events = POLLIN;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->user_data = TAG_WAKE;
+      return true;
+    }
+
+    bool armRecv(TSocket s) {
+      io_uring_sqe* sqe = getSqe();
+      if (!sqe)
+        return false;
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = s;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = buffer_group;
+      sqe->user_data = socketUserData(TAG_RECV, s);
+      slot(s).recv_armed = true;
+      return true;
+    }
+
+    // Sends the parts not yet sent of the first answer queued
+    void submitSend(TSocket s) {
+      TSlot& sl = slot(s);
+      if (sl.sends.empty())
+        return;
+      int idx = sl.sends.front();
+      TSend& op = sends[idx];
+      op.pending = false;
+      memset(&op.msg, 0x00, sizeof(op.msg));
+      op.msg.msg_iov = op.iov;
+      op.msg.msg_iovlen = pendingParts(op.iov, op.parts[0].data(), op.parts[0].size(), op.body, op.body_size, op.sent);
+      if (!op.msg.msg_iovlen && op.left) {
+        if (!readPiece(op)) {
+          // The client can't get the full answer. The next read closes it
+          if( reactor->owner->trace ) printf("http_server.Failed to read file for client %d\n", (int)s);
+          shutdownSocket(s);
+          sl.failed = true;
+          finishSend(s);
+          return;
+        }
+        op.msg.msg_iovlen = pendingParts(op.iov, nullptr, 0, op.body, op.body_size, 0);
+      }
+      if (!op.msg.msg_iovlen) {
+        finishSend(s);
+        return;
+      }
+      io_uring_sqe* sqe = getSqe();
+      if (!sqe) {
+        sl.failed = true;
+        if (sl.closing)
+          release(s);
+        else
+          reactor->closeClient(s);
+        return;
+      }
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = s;
+      sqe->addr = (uint64_t)&op.msg;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      sqe->user_data = ((uint64_t)idx << 8) | TAG_SEND;
+      op.pending = true;
+    }
+
+    void finishSend(TSocket s) {
+      TSlot& sl = slot(s);
+      freeSend(sl.sends.front());
+      sl.sends.erase(sl.sends.begin());
+      if (sl.closing)
+        release(s);
+      else
+        submitSend(s);
+    }
+
+    // Closes the file and drops the shared bytes of a send no longer used
+    void freeSend(int idx) {
+      TSend& op = sends[idx];
+      if (op.file >= 0)
+        closeFile(op.file);
+      op.file = -1;
+      op.left = 0;
+      op.keep.reset();
+      op.body = nullptr;
+      op.body_size = 0;
+      free_sends.push_back(idx);
+    }
+
+    TSend& newSend(TSocket s, VBytes& header) {
+      int idx;
+      if (free_sends.empty()) {
+        idx = (int)sends.size();
+        sends.emplace_back();
+      }
+      else {
+        idx = free_sends.back();
+        free_sends.pop_back();
+      }
+      TSend& op = sends[idx];
+      op.fd = s;
+      op.parts[0].swap(header);
+      op.parts[1].clear();
+      op.sent = 0;
+      op.pending = false;
+      slot(s).sends.push_back(idx);
+      return op;
+    }
+
+    void queueSend(TSocket s) {
+      if (slot(s).sends.size() == 1)
+        submitSend(s);
+    }
+
+    // Replaces what was sent with the next piece of the file
+    bool readPiece(TSend& op) {
+      op.parts[0].clear();
+      op.parts[1].resize((size_t)std::min<uint64_t>(op.left, (uint64_t)file_piece_size));
+      long nbytes_read = readFileAt(op.file, op.offset, op.parts[1].data(), op.parts[1].size());
+      if (nbytes_read != (long)op.parts[1].size())
+        return false;
+      op.offset += op.parts[1].size();
+      op.left -= op.parts[1].size();
+      op.body = op.parts[1].data();
+      op.body_size = op.parts[1].size();
+      op.sent = 0;
+      return true;
+    }
+
+    // The bytes are copied, as the caller may reuse them once we return
+    void send(TSocket s, VBytes& header, const char* body, size_t body_size) {
+      TSend& op = newSend(s, header);
+      op.parts[1].assign(body, body + body_size);
+      op.body = op.parts[1].data();
+      op.body_size = op.parts[1].size();
+      queueSend(s);
+    }
+
+    // The bytes are referenced until they have been sent
+    void sendShared(TSocket s, VBytes& header, const std::shared_ptr<const void>& keep, const char* data, size_t size) {
+      TSend& op = newSend(s, header);
+      op.keep = keep;
+      op.body = data;
+      op.body_size = size;
+      queueSend(s);
+    }
+
+    // Takes the file, which is read a piece at a time after the header
+    // has been sent, so big files are never fully in memory
+    void sendFile(TSocket s, VBytes& header, int file, uint64_t offset, uint64_t size) {
+      TSend& op = newSend(s, header);
+      op.file = file;
+      op.offset = offset;
+      op.left = size;
+      queueSend(s);
+    }
+
+    // -------------------------------------------------------
+    // Cancel the recv and close the socket once nothing refers to it
+    void closeClient(TSocket s) {
+      TSlot& sl = slot(s);
+      if (sl.closing)
+        return;
+      sl.closing = true;
+      if (sl.recv_armed)
+        cancelRecv(s);
+      release(s);
+    }
+
+    void cancelRecv(TSocket s) {
+      io_uring_sqe* sqe = getSqe();
+      if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = socketUserData(TAG_RECV, s);
+        sqe->user_data = TAG_CANCEL;
+      }
+    }
+
+    // The recv is canceled, and armed again when it is read again. What
+    // was already received meanwhile is still delivered
+    void watchRead(TSocket s, bool on) {
+      TSlot& sl = slot(s);
+      if (sl.closing || sl.paused == !on)
+        return;
+      sl.paused = !on;
+      if (on && !sl.recv_armed)
+        armRecv(s);
+      else if (!on && sl.recv_armed)
+        cancelRecv(s);
+    }
+
+    void release(TSocket s) {
+      TSlot& sl = slot(s);
+      if (!sl.closing || sl.recv_armed)
+        return;
+      // The answers queued are still sent, unless the client is gone
+      while (!sl.sends.empty()) {
+        if (sends[sl.sends.front()].pending)
+          return;
+        if (!sl.failed) {
+          submitSend(s);
+          return;
+        }
+        freeSend(sl.sends.front());
+        sl.sends.erase(sl.sends.begin());
+      }
+      ::closesocket(s);
+      sl.gen++;
+      sl.closing = false;
+      sl.paused = false;
+      sl.failed = false;
+    }
+
+    // -------------------------------------------------------
+    void onCompletion(uint64_t user_data, int res, unsigned flags) {
+      bool more = (flags & IORING_CQE_F_MORE) != 0;
+      switch (user_data & TAG_MASK) {
+
+      case TAG_ACCEPT:
+        if (res >= 0) {
+          TSocket client = res;
+          slot(client).closing = false;
+          reactor->addClient(client);
+          armRecv(client);
+        }
+        if (!more)
+          armAccept();
+        break;
+
+      case TAG_WAKE:
+        // The answers are collected at the end of the tick
+        if (res > 0) {
+          uint64_t value;
+          if (::read(reactor->wake_fds[0], &value, sizeof(value)) < 0) { }
+        }
+        if (!more)
+          armWake();
+        break;
+
+      case TAG_RECV: {
+        TSocket s = (TSocket)(user_data >> 32);
+        TSlot& sl = slot(s);
+        bool stale = (socketUserData(TAG_RECV, s) != user_data);
+        if (flags & IORING_CQE_F_BUFFER) {
+          unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+          buffers_to_recycle.push_back(bid);
+          if (res > 0 && !stale && !sl.closing) {
+            char* data = buffers.data() + bid * buffer_size;
+            if (!reactor->processInput(s, data, res))
+              reactor->closeClient(s);
+          }
+        }
+        if (!more && !stale) {
+          sl.recv_armed = false;
+          // Out of buffers, just ask again. Canceled to pause it, or
+          // resumed before the cancel arrived
+          if ((res == -ENOBUFS || res == -ECANCELED) && !sl.closing) {
+            if (!sl.paused)
+              armRecv(s);
+          }
+          else if (!sl.closing)
+            reactor->closeClient(s);
+          else
+            release(s);
+        }
+        break; }
+
+      case TAG_SEND: {
+        int idx = (int)(user_data >> 8);
+        TSend& op = sends[idx];
+        TSocket s = op.fd;
+        op.pending = false;
+        TSlot& sl = slot(s);
+        if (res > 0)
+          op.sent += res;
+        else {
+          sl.failed = true;
+          reactor->closeClient(s);
+        }
+        if (sl.closing)
+          release(s);
+        else
+          submitSend(s);     // Retries the short sends or moves to the next answer
+        break; }
+      }
+    }
+
+    bool tick(unsigned timeout_usecs) {
+      unsigned head = *cq_head;
+      if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        enter(timeout_usecs ? 1 : 0, timeout_usecs);
+
+      reactor->updateClock();
+      bool activity = false;
+      while (true) {
+        head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+          break;
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        onCompletion(cqe.user_data, cqe.res, cqe.flags);
+        activity = true;
+      }
+
+      // Submit the requests generated while processing
+      recycleBuffers();
+      enter(0, 0);
+      return activity;
+    }
+  };
+
+#endif
+
+  // -------------------------------------------------------
+  void CBaseServer::TReactor::addClient(TSocket client) {
+    if( owner->trace ) printf("http_server.New client at socket %d\n", (int)client);
+    active_sockets.emplace_back(client);
+    TConnection& c = connections[client];
+    c = TConnection();
+    c.socket = client;
+    touch(c);
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::TReactor::updateClock() {
+    now = nowInSecs();
+  }
+
+  // -------------------------------------------------------
+  // Keep the connections sorted by the last time we heard from them.
+  // The ones with output queued are not idle, however slow the client
+  // reads it, and are linked again once it has been sent
+  void CBaseServer::TReactor::touch(TConnection& c) {
+    unlink(c);
+    c.last_active = now;
+    if (!c.output.empty())
+      return;
+    c.prev = newest;
+    if (newest)
+      newest->next = &c;
+    else
+      oldest = &c;
+    newest = &c;
+  }
+
+  void CBaseServer::TReactor::unlink(TConnection& c) {
+    if (c.prev)
+      c.prev->next = c.next;
+    else if (oldest == &c)
+      oldest = c.next;
+    if (c.next)
+      c.next->prev = c.prev;
+    else if (newest == &c)
+      newest = c.prev;
+    c.prev = c.next = nullptr;
+  }
+
+  void CBaseServer::TReactor::closeIdleClients() {
+    while (oldest && now - oldest->last_active >= owner->keep_alive_timeout_secs) {
+      TConnection* c = oldest;
+      unlink(*c);
+      if( owner->trace ) printf("http_server.Closing idle client at socket %d\n", (int)c->socket);
+      closeClient(c->socket);
+    }
+  }
+
+  // -------------------------------------------------------
+  TSocket CBaseServer::TReactor::acceptNewClient() {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+#if defined( __linux__ )
+    auto client = ::accept4(server, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client < 0)
+      return client;
+#else
+    auto client = ::accept(server, (struct sockaddr *)&client_addr, &addr_len);
+    if (client < 0)
+      return client;
+    setNonBlocking(client);
+#endif
+    if (!activity.add(client)) {
+      if( owner->trace ) printf("http_server.Can't watch client at socket %d\n", (int)client);
+      ::closesocket(client);
+      return -1;
+    }
+    addClient(client);
+    return client;
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::TReactor::closeClient(TSocket s) {
+    auto it = connections.find(s);
+    if (it != connections.end()) {
+      TConnection& c = it->second;
+      unlink(c);
+      // Stop reading, but keep the socket until the worker has answered
+      if (c.busy) {
+        if (!c.closing) {
+          c.closing = true;
+          active_sockets.detach(s);
+          if (!uring)
+            activity.remove(s);
+        }
+        return;
+      }
+      bool was_closing = c.closing;
+      dropOutput(c);
+      giveBuffer(c.partial);
+      connections.erase(it);
+      if (was_closing) {
+#if HTTP_HAS_IO_URING
+        if (uring) {
+          uring->closeClient(s);
+          return;
+        }
+#endif
+        ::closesocket(s);
+        return;
+      }
+    }
+
+#if HTTP_HAS_IO_URING
+    if (uring) {
+      active_sockets.detach(s);
+      uring->closeClient(s);
+      return;
+    }
+#endif
+    activity.remove(s);
+    active_sockets.remove(s);
+  }
+
+  // -------------------------------------------------------
+  // data has the bytes just received. All the complete requests are handled
+  // from there directly, and only what is left is copied to the connection
+  // until the rest arrives. Returns false when the client should be closed
+  bool CBaseServer::TReactor::processInput(TSocket s, char* data, size_t size) {
+    TConnection& c = connections[s];
+    if (!c.busy)
+      touch(c);
+    bool in_partial = !c.partial.empty() || c.busy;
+    size_t scanned = 0;
+    if (in_partial) {
+      if (!c.partial.capacity())
+        takeBuffer(c.partial);
+      c.partial.insert(c.partial.end(), data, data + size);
+      data = c.partial.data();
+      size = c.partial.size();
+      scanned = c.scanned;
+    }
+
+    // One request per client in the workers, so the answers keep the order
+    // Stop too while the client is not reading our answers, but not in
+    // the middle of a body, which does not answer anything
+    size_t start = 0;
+    while (!c.busy && (c.output.empty() || c.body.state != TBodyReader::DONE)) {
+      if (c.body.state != TBodyReader::DONE) {
+        size_t used = 0;
+        bool ok = readBody(s, c, data + start, size - start, used);
+        start += used;
+        scanned = start;
+        if (ok && c.body.state != TBodyReader::DONE)
+          break;
+        TJob* job = c.body.job.release();
+        c.body = TBodyReader();
+        if (ok && (!job || runJob(s, c, job)))
+          continue;
+        if (!ok && job)
+          owner->freeJob(job);
+        if (c.output.empty())
+          return false;
+        c.close_when_sent = true;
+        break;
+      }
+
+      size_t end = findEndOfRequest(data, std::max(scanned, start), size);
+      if (!end) {
+        scanned = size;
+        break;
+      }
+      if (!handleRequest(s, c, data + start, end - start)) {
+        if (c.output.empty())
+          return false;
+        c.close_when_sent = true;
+      }
+      start = end;
+      scanned = end;
+    }
+
+    if (in_partial)
+      c.partial.erase(c.partial.begin(), c.partial.begin() + start);
+    else if (start < size) {
+      takeBuffer(c.partial);
+      c.partial.assign(data + start, data + size);
+    }
+    c.scanned = std::max(scanned, start) - start;
+
+    // Idle connections give their buffer back
+    if (c.partial.empty() && c.partial.capacity())
+      giveBuffer(c.partial);
+
+    // The answer of the request in the workers is never dropped because
+    // of what came after it, which is checked once it is done
+    if (!c.busy && c.partial.size() > owner->max_request_size) {
+      if( owner->trace ) printf("http_server.Request too long from socket %d\n", (int)s);
+      return false;
+    }
+    return true;
+  }
+
+  // -------------------------------------------------------
+  // Inflates a gzip or deflate body as it arrives. The 32Kb window tinfl
+  // needs is also the output, so nothing else is buffered
+  struct CBaseServer::TInflateStream {
+    enum eState { HEADER, INFLATE, TRAILER, DONE, FAILED };
+#if !DISABLE_MINIZ_SUPPORT
+    tinfl_decompressor inflator;
+    char        window[TINFL_LZ_DICT_SIZE];
+#endif
+    size_t      window_pos = 0;
+    eState      state = FAILED;
+    bool        gzip = false;
+    int         flags = 0;
+    uint32_t    crc = 0;
+    uint32_t    total = 0;
+    std::string pending;                  // Header or trailer bytes not complete yet
+
+    bool begin(bool new_gzip);
+    bool done() const { return state == DONE; }
+
+    // Calls out(data, size) with the inflated bytes. Returns false when
+    // the data is corrupt or out returns false
+    template< typename TOut >
+    bool feed(const char* data, size_t size, TOut out);
+  };
+
+#if DISABLE_MINIZ_SUPPORT
+
+  bool CBaseServer::TInflateStream::begin(bool new_gzip) {
+    return false;
+  }
+
+  template< typename TOut >
+  bool CBaseServer::TInflateStream::feed(const char* data, size_t size, TOut out) {
+    return false;
+  }
+
+#else
+
+  // 0 while incomplete, -1 when it's not a gzip header
+  static int gzipHeaderSize(const unsigned char* p, size_t size) {
+    if (size < 10)
+      return 0;
+    if (p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+      return -1;
+    int flags = p[3];
+    size_t pos = 10;
+    if (flags & 4) {                      // Extra field
+      if (size < pos + 2)
+        return 0;
+      pos += 2 + (p[pos] | (p[pos + 1] << 8));
+    }
+    for (int zero_terminated : { 8, 16 }) {   // Name, comment
+      if (!(flags & zero_terminated))
+        continue;
+      auto zero = pos < size ? (const unsigned char*)memchr(p + pos, 0, size - pos) : nullptr;
+      if (!zero)
+        return 0;
+      pos = zero - p + 1;
+    }
+    if (flags & 2)                        // Header crc
+      pos += 2;
+    return size < pos ? 0 : (int)pos;
+  }
+
+  bool CBaseServer::TInflateStream::begin(bool new_gzip) {
+    tinfl_init(&inflator);
+    window_pos = 0;
+    state = HEADER;
+    gzip = new_gzip;
+    flags = TINFL_FLAG_HAS_MORE_INPUT;
+    crc = MZ_CRC32_INIT;
+    total = 0;
+    pending.clear();
+    return true;
+  }
+
+  template< typename TOut >
+  bool CBaseServer::TInflateStream::feed(const char* data, size_t size, TOut out) {
+    if (state == HEADER) {
+      pending.append(data, size);
+      auto p = (const unsigned char*)pending.data();
+      int header_size = 0;
+      if (gzip) {
+        header_size = gzipHeaderSize(p, pending.size());
+        if (header_size < 0 || (!header_size && pending.size() > 64 * 1024))
+          state = FAILED;
+        if (header_size <= 0)
+          return state != FAILED;
+      }
+      else {
+        // HTTP says zlib, but some clients send raw deflate
+        if (pending.size() < 2)
+          return true;
+        if ((p[0] & 0x0f) == 8 && ((p[0] << 8) | p[1]) % 31 == 0)
+          flags |= TINFL_FLAG_PARSE_ZLIB_HEADER;
+      }
+      state = INFLATE;
+      std::string input;
+      input.swap(pending);
+      return feed(input.data() + header_size, input.size() - header_size, out);
+    }
+
+    while (state == INFLATE) {
+      size_t in_size = size;
+      size_t out_size = TINFL_LZ_DICT_SIZE - window_pos;
+      mz_uint8* out_next = (mz_uint8*)window + window_pos;
+      tinfl_status status = tinfl_decompress(&inflator, (const mz_uint8*)data, &in_size, (mz_uint8*)window, out_next, &out_size, flags);
+      data += in_size;
+      size -= in_size;
+      if (out_size) {
+        if (gzip) {
+          crc = (uint32_t)mz_crc32(crc, out_next, out_size);
+          total += (uint32_t)out_size;
+        }
+        if (!out((const char*)out_next, out_size)) {
+          state = FAILED;
+          return false;
+        }
+        window_pos = (window_pos + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+      }
+      if (status == TINFL_STATUS_DONE)
+        state = gzip ? TRAILER : DONE;
+      else if (status < 0)
+        state = FAILED;
+      else if (status == TINFL_STATUS_NEEDS_MORE_INPUT)
+        return true;
+    }
+
+    // crc32 and size of the input, little endian
+    if (state == TRAILER) {
+      pending.append(data, size);
+      if (pending.size() < 8)
+        return true;
+      auto p = (const unsigned char*)pending.data();
+      uint32_t trailer[2];
+      for (int i = 0; i < 2; ++i, p += 4)
+        trailer[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+      state = pending.size() == 8 && trailer[0] == crc && trailer[1] == total ? DONE : FAILED;
+      pending.clear();
+      return state == DONE;
+    }
+
+    // Nothing may follow the compressed data
+    if (state == DONE && size)
+      state = FAILED;
+    return state != FAILED;
+  }
+
+#endif
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::handleRequest(TSocket s, TConnection& c, char* data, size_t size) {
+    c.nrequests++;
+    bool last_request = c.nrequests >= owner->max_requests_per_connection;
+
+    // Requests with a body must outlive the buffer they came in, so they
+    // get a job also without workers
+    bool is_get = (size >= 4 && memcmp(data, "GET ", 4) == 0) || (size >= 5 && memcmp(data, "HEAD ", 5) == 0);
+    if (!owner->workers_running && is_get) {
+      TRequest r;
+      r.client = s;
+      r.reactor = this;
+      if (!r.parse(data, size, owner->trace))
+        return rejectRequest(s, r);
+      if (last_request)
+        r.keep_alive = false;
+      if (r.hasBody() && !startBody(s, c, r, nullptr))
+        return false;
+      return owner->callHandler(r);
+    }
+
+    TJob* job = owner->newJob();
+    job->buf.assign(data, data + size);
+    TRequest& r = job->request;
+    r.client = s;
+    r.reactor = this;
+    if (!r.parse(job->buf, owner->trace)) {
+      rejectRequest(s, r);
+      owner->freeJob(job);
+      return false;
+    }
+    if (last_request)
+      r.keep_alive = false;
+    if (r.hasBody()) {
+      if (r.method != TRequest::GET && r.method != TRequest::HEAD)
+        return startBody(s, c, r, job);
+      if (!startBody(s, c, r, nullptr)) {
+        owner->freeJob(job);
+        return false;
+      }
+    }
+    return runJob(s, c, job);
+  }
+
+  // -------------------------------------------------------
+  // The request is complete. Without workers, it is handled now
+  bool CBaseServer::TReactor::runJob(TSocket s, TConnection& c, TJob* job) {
+    if (!owner->workers_running) {
+      bool keep = owner->callHandler(job->request);
+      owner->freeJob(job);
+      return keep;
+    }
+    c.busy = true;
+    unlink(c);
+    watchRead(s, c);
+    if (!dispatch(job))
+      parked.push_back(job);
+    return true;
+  }
+
+  // The socket is not read while a worker has its request, so the input
+  // of a client does not pile up while it waits for the answer
+  void CBaseServer::TReactor::watchRead(TSocket s, TConnection& c) {
+#if HTTP_HAS_IO_URING
+    if (uring) {
+      uring->watchRead(s, !c.busy);
+      return;
+    }
+#endif
+    activity.watch(s, !c.busy, !c.output.empty());
+  }
+
+  // -------------------------------------------------------
+  // The connection keeps the job until the body has arrived. Returns
+  // false, and frees the job, when the body is not accepted
+  bool CBaseServer::TReactor::startBody(TSocket s, TConnection& c, TRequest& r, TJob* job) {
+    if (!r.chunked && r.content_length > owner->max_body_size) {
+      if( owner->trace ) printf("http_server.Body of %llu bytes too long from socket %d\n", (unsigned long long)r.content_length, (int)s);
+      rejectBody(s, r);
+      if (job)
+        owner->freeJob(job);
+      return false;
+    }
+
+    // Clients waiting for permission to send the body
+    const char* expect = r.getHeader(TRequest::HEADER_EXPECT);
+    if (job && expect && r.version == 11 && strcasecmp(expect, "100-continue") == 0) {
+      static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      TPooledBytes header;
+      header.assign(continue_line, continue_line + sizeof(continue_line) - 1);
+      sendNow(s, header, VBytes());
+    }
+
+    c.body.state = r.chunked ? TBodyReader::CHUNK_SIZE : TBodyReader::DATA;
+    c.body.remaining = r.content_length;
+    c.body.received = 0;
+    c.body.job.reset(job);
+
+    // Other encodings are passed as they are
+    c.body.inflating = false;
+    const char* coding = r.getHeader(TRequest::HEADER_CONTENT_ENCODING);
+    if (job && coding) {
+      bool gzip = strcasecmp(coding, "gzip") == 0 || strcasecmp(coding, "x-gzip") == 0;
+      if (gzip || strcasecmp(coding, "deflate") == 0) {
+        if (!c.inflater)
+          c.inflater = std::make_shared<TInflateStream>();
+        c.body.inflating = c.inflater->begin(gzip);
+      }
+    }
+    return true;
+  }
+
+  void CBaseServer::TReactor::rejectBody(TSocket s, TRequest& r) {
+    r.keep_alive = false;
+    TPooledBytes header;
+    owner->formatHeader(header, r, "413 Payload Too Large", 0, "text/plain", "");
+    sendNow(s, header, VBytes());
+  }
+
+  // Where the next request starts is not known after one we can't parse,
+  // so it is answered and the connection closed. Returns false
+  bool CBaseServer::TReactor::rejectRequest(TSocket s, TRequest& r) {
+    if( owner->trace ) printf("http_server.Bad request from socket %d\n", (int)s);
+    r.keep_alive = false;
+    TPooledBytes header;
+    const char* status = r.method == TRequest::UNSUPPORTED ? "501 Not Implemented" : "400 Bad Request";
+    owner->formatHeader(header, r, status, 0, "text/plain", "");
+    sendNow(s, header, VBytes());
+    return false;
+  }
+
+  // -------------------------------------------------------
+  // Passes the body bytes found in data to onClientBody, without copying
+  // them. used tells how many belong to the body. Returns false when the
+  // client should be closed
+  bool CBaseServer::TReactor::readBody(TSocket s, TConnection& c, const char* data, size_t size, size_t& used) {
+    TBodyReader& b = c.body;
+    TRequest* r = b.job ? &b.job->request : nullptr;
+    used = 0;
+    while (used < size && b.state != TBodyReader::DONE) {
+      const char* p = data + used;
+      size_t available = size - used;
+
+      if (b.state == TBodyReader::DATA || b.state == TBodyReader::CHUNK_DATA) {
+        size_t n = (size_t)std::min<uint64_t>(b.remaining, available);
+        b.received += n;
+        if (b.received > owner->max_body_size) {
+          if( owner->trace ) printf("http_server.Chunked body too long from socket %d\n", (int)s);
+          if (r)
+            rejectBody(s, *r);
+          return false;
+        }
+        if (r && !deliverBody(s, c, *r, p, n))
+          return false;
+        used += n;
+        b.remaining -= n;
+        if (!b.remaining)
+          b.state = b.state == TBodyReader::DATA ? TBodyReader::DONE : TBodyReader::CHUNK_END;
+        continue;
+      }
+
+      if (b.state == TBodyReader::CHUNK_END) {
+        if (available < 2)
+          return true;
+        if (p[0] != '\r' || p[1] != '\n')
+          return false;
+        used += 2;
+        b.state = TBodyReader::CHUNK_SIZE;
+        continue;
+      }
+
+      // The size of the next chunk or a trailer, in a line of its own.
+      // Until the line is complete it waits in the connection
+      auto eol = (const char*)memchr(p, '\n', available);
+      if (!eol)
+        return true;
+      used += eol - p + 1;
+      if (b.state == TBodyReader::TRAILERS) {
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+          b.state = TBodyReader::DONE;
+        continue;
+      }
+
+      // 1a3f;name=value\r\n
+      uint64_t chunk_size = 0;
+      int digits = 0;
+      for (; p < eol && hexValue(*p) >= 0; ++p, ++digits)
+        chunk_size = chunk_size * 16 + hexValue(*p);
+      if (!digits || digits > 15)
+        return false;
+      b.remaining = chunk_size;
+      b.state = chunk_size ? TBodyReader::CHUNK_DATA : TBodyReader::TRAILERS;
+    }
+
+    // A compressed body must end with the compressed stream
+    if (b.state == TBodyReader::DONE && b.inflating && !c.inflater->done()) {
+      if( owner->trace ) printf("http_server.Truncated compressed body from socket %d\n", (int)s);
+      return false;
+    }
+    return true;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::deliverBody(TSocket s, TConnection& c, TRequest& r, const char* data, size_t size) {
+    if (!c.body.inflating) {
+      r.body_size += size;
+      return owner->onClientBody(r, data, size);
+    }
+
+    // Limiting the inflated size stops the zip bombs
+    bool too_long = false;
+    bool ok = c.inflater->feed(data, size, [&](const char* out, size_t n) {
+      r.body_size += n;
+      if (r.body_size > owner->max_body_size) {
+        too_long = true;
+        return false;
+      }
+      return owner->onClientBody(r, out, n);
+    });
+    if (too_long) {
+      if( owner->trace ) printf("http_server.Inflated body too long from socket %d\n", (int)s);
+      rejectBody(s, r);
+    }
+    else if (!ok && owner->trace)
+      printf("http_server.Bad compressed body from socket %d\n", (int)s);
+    return ok;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::dispatch(TJob* job) {
+    job->queued_at = std::chrono::steady_clock::now();
+    if (!owner->jobs.push(job))
+      return false;
+    size_t depth = owner->jobs.size();
+    size_t max_depth = owner->stats_max_queue_depth;
+    while (depth > max_depth && !owner->stats_max_queue_depth.compare_exchange_weak(max_depth, depth)) { }
+    // Pairs with the fence in runWorker, so a worker going to sleep sees the job
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (owner->workers_sleeping > 0) {
+      std::lock_guard<std::mutex> lock(owner->workers_mutex);
+      owner->workers_cv.notify_one();
+    }
+    return true;
+  }
+
+  // -------------------------------------------------------
+  // Called from the workers
+  void CBaseServer::TReactor::post(TAnswer* answer) {
+    while (!answers.push(answer)) {
+      // Nobody collects the answers once the server is closing
+      if (owner->stopping) {
+        owner->dropAnswer(answer);
+        return;
+      }
+      wake();
+      std::this_thread::yield();
+    }
+    wake();
+  }
+
+  // The answers of a worker are posted one behind, so the last one also
+  // carries the end of the request. Otherwise the client could get its
+  // answer, and send more, while the reactor still sees it busy
+  void CBaseServer::TReactor::hold(TAnswer* answer) {
+    TAnswer*& held = owner->heldAnswer();
+    if (held)
+      held->reactor->post(held);
+    answer->reactor = this;
+    held = answer;
+  }
+
+  CBaseServer::TAnswer*& CBaseServer::heldAnswer() {
+    static thread_local TAnswer* held = nullptr;
+    return held;
+  }
+
+  void CBaseServer::TReactor::wake() {
+    if (wake_fds[1] == INVALID_SOCKET)
+      return;
+#if defined( _WIN32 )
+    if (::send(wake_fds[1], "w", 1, 0) < 0) {
+      // Full socket. The reactor is already awake
+    }
+#else
+    // eventfd requires 8 bytes
+    uint64_t value = 1;
+    if (::write(wake_fds[1], &value, wake_fds[0] == wake_fds[1] ? sizeof(value) : 1) < 0) {
+      // Full pipe. The reactor is already awake
+    }
+#endif
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::TReactor::drainAnswers() {
+    TAnswer* answer;
+    while (answers.pop(answer)) {
+      TSocket s = answer->client;
+      if (answer->file >= 0) {
+        sendFileNow(s, answer->header, answer->file, answer->offset, answer->size);
+        answer->file = -1;
+      }
+      else if (answer->shared)
+        sendSharedNow(s, answer->header, answer->shared, answer->shared_data, (size_t)answer->size);
+      else if (!answer->header.empty() || !answer->body.empty())
+        sendNow(s, answer->header, answer->body);
+      if (!answer->done) {
+        owner->freeAnswer(answer);
+        continue;
+      }
+
+      owner->freeJob(answer->done);
+      bool keep = answer->keep;
+      owner->freeAnswer(answer);
+
+      TConnection& c = connections[s];
+      c.busy = false;
+      if (!keep && !c.output.empty() && !c.closing) {
+        c.close_when_sent = true;
+        continue;
+      }
+      if (!keep || c.closing) {
+        closeClient(s);
+        continue;
+      }
+      touch(c);
+      watchRead(s, c);
+      // Continue with the requests received meanwhile
+      if (!c.partial.empty()) {
+        if (!processInput(s, nullptr, 0))
+          closeClient(s);
+      }
+    }
+
+    // Retry the requests which didn't fit in the queue
+    size_t n = 0;
+    while (n < parked.size() && dispatch(parked[n]))
+      ++n;
+    parked.erase(parked.begin(), parked.begin() + n);
+  }
+
+  // -------------------------------------------------------
+  // sendAnswer is called from the workers when they are running
+  bool CBaseServer::TReactor::send(TSocket s, VBytes& header, const char* body, size_t body_size) {
+    if (owner->workers_running) {
+      TAnswer* answer = owner->newAnswer();
+      answer->client = s;
+      answer->header.swap(header);
+      answer->body.assign(body, body + body_size);
+      answer->done = nullptr;
+      hold(answer);
+      return true;
+    }
+    return sendNow(s, header, body, body_size);
+  }
+
+  // Whatever the kernel does not take now is queued in the connection
+  // and sent when the socket becomes writable. Returns false then
+  bool CBaseServer::TReactor::sendNow(TSocket s, VBytes& header, const char* body, size_t body_size) {
+    auto it = connections.find(s);
+    if (it == connections.end() || it->second.closing)
+      return false;
+    TConnection& c = it->second;
+#if HTTP_HAS_IO_URING
+    if (uring) {
+      uring->send(s, header, body, body_size);
+      return true;
+    }
+#endif
+    size_t sent = 0;
+    if (c.output.empty()) {
+      if (!sendParts(s, header.data(), header.size(), body, body_size, sent)) {
+        // The next read will find the client is gone
+        if( owner->trace ) printf("http_server.Failed to send answer to client %d\n", (int)s);
+        return false;
+      }
+      if (sent == header.size() + body_size)
+        return true;
+      activity.watch(s, !c.busy, true);
+      unlink(c);
+    }
+
+    if (sent < header.size()) {
+      queueOutput(c, header.data() + sent, header.size() - sent);
+      sent = 0;
+    }
+    else
+      sent -= header.size();
+    queueOutput(c, body + sent, body_size - sent);
+    return false;
+  }
+
+  // -------------------------------------------------------
+  // Like send, for a range of a file we own
+  bool CBaseServer::TReactor::sendFile(TSocket s, VBytes& header, int file, uint64_t offset, uint64_t size) {
+    if (owner->workers_running) {
+      TAnswer* answer = owner->newAnswer();
+      answer->client = s;
+      answer->header.swap(header);
+      answer->body.clear();
+      answer->file = file;
+      answer->offset = offset;
+      answer->size = size;
+      answer->done = nullptr;
+      hold(answer);
+      return true;
+    }
+    return sendFileNow(s, header, file, offset, size);
+  }
+
+  bool CBaseServer::TReactor::sendFileNow(TSocket s, VBytes& header, int file, uint64_t offset, uint64_t size) {
+    auto it = connections.find(s);
+    if (it == connections.end() || it->second.closing) {
+      closeFile(file);
+      return false;
+    }
+    TConnection& c = it->second;
+#if HTTP_HAS_IO_URING
+    // Our sends are queued in the ring, so the range is read in memory
+    // a piece at a time
+    if (uring) {
+      uring->sendFile(s, header, file, offset, size);
+      return true;
+    }
+#endif
+    static const VBytes no_body;
+    size_t sent = 0;
+    if (c.output.empty()) {
+      if (!sendParts(s, header, no_body, sent)
+        || (sent == header.size() && !sendFilePart(s, file, offset, size))) {
+        // The client can't get the full answer. The next read closes it
+        if( owner->trace ) printf("http_server.Failed to send file to client %d\n", (int)s);
+        shutdownSocket(s);
+        closeFile(file);
+        return false;
+      }
+      if (sent == header.size() && !size) {
+        closeFile(file);
+        return true;
+      }
+      activity.watch(s, !c.busy, true);
+      unlink(c);
+    }
+
+    queueOutput(c, header.data() + sent, header.size() - sent);
+    c.output.emplace_back();
+    TOutput& out = c.output.back();
+    out.file = file;
+    out.offset = offset;
+    out.size = size;
+    return false;
+  }
+
+  // -------------------------------------------------------
+  // Like send, for bytes owned by someone else, like a cached file.
+  // The answer keeps a reference until they have been sent
+  bool CBaseServer::TReactor::sendShared(TSocket s, VBytes& header, const std::shared_ptr<const void>& keep, const char* data, size_t size) {
+    if (owner->workers_running) {
+      TAnswer* answer = owner->newAnswer();
+      answer->client = s;
+      answer->header.swap(header);
+      answer->body.clear();
+      answer->shared = keep;
+      answer->shared_data = data;
+      answer->size = size;
+      answer->done = nullptr;
+      hold(answer);
+      return true;
+    }
+    return sendSharedNow(s, header, keep, data, size);
+  }
+
+  bool CBaseServer::TReactor::sendSharedNow(TSocket s, VBytes& header, const std::shared_ptr<const void>& keep, const char* data, size_t size) {
+    auto it = connections.find(s);
+    if (it == connections.end() || it->second.closing)
+      return false;
+    TConnection& c = it->second;
+#if HTTP_HAS_IO_URING
+    if (uring) {
+      uring->sendShared(s, header, keep, data, size);
+      return true;
+    }
+#endif
+    size_t sent = 0;
+    if (c.output.empty()) {
+      if (!sendParts(s, header.data(), header.size(), data, size, sent)) {
+        if( owner->trace ) printf("http_server.Failed to send answer to client %d\n", (int)s);
+        return false;
+      }
+      if (sent == header.size() + size)
+        return true;
+      activity.watch(s, !c.busy, true);
+      unlink(c);
+    }
+
+    if (sent < header.size()) {
+      queueOutput(c, header.data() + sent, header.size() - sent);
+      sent = 0;
+    }
+    else
+      sent -= header.size();
+    c.output.emplace_back();
+    TOutput& out = c.output.back();
+    out.shared = keep;
+    out.shared_data = data;
+    out.offset = sent;
+    out.size = size - sent;
+    return false;
+  }
+
+  void CBaseServer::TReactor::queueOutput(TConnection& c, const char* data, size_t size) {
+    if (!size)
+      return;
+    if (c.output.empty() || c.output.back().file >= 0 || c.output.back().shared) {
+      c.output.emplace_back();
+      takeBuffer(c.output.back().data);
+    }
+    VBytes& out = c.output.back().data;
+    out.insert(out.end(), data, data + size);
+  }
+
+  void CBaseServer::TReactor::dropOutput(TConnection& c) {
+    for (auto& out : c.output) {
+      if (out.file >= 0)
+        closeFile(out.file);
+      giveBuffer(out.data);
+    }
+    c.output.clear();
+    c.output_sent = 0;
+  }
+
+  // -------------------------------------------------------
+  // The socket is writable
+  void CBaseServer::TReactor::flushOutput(TSocket s) {
+    auto it = connections.find(s);
+    if (it == connections.end())
+      return;
+    TConnection& c = it->second;
+    static const VBytes no_body;
+    while (!c.output.empty()) {
+      TOutput& out = c.output.front();
+      bool done;
+      if (out.shared) {
+        size_t sent = 0;
+        if (!sendParts(s, out.shared_data + out.offset, (size_t)out.size, nullptr, 0, sent)) {
+          closeClient(s);
+          return;
+        }
+        out.offset += sent;
+        out.size -= sent;
+        done = out.size == 0;
+      }
+      else if (out.file < 0) {
+        size_t sent = c.output_sent;
+        if (!sendParts(s, out.data, no_body, sent)) {
+          closeClient(s);
+          return;
+        }
+        c.output_sent = sent;
+        done = sent == out.data.size();
+      }
+      else {
+        if (!sendFilePart(s, out.file, out.offset, out.size)) {
+          closeClient(s);
+          return;
+        }
+        done = out.size == 0;
+      }
+      if (!done)
+        break;
+      if (out.file >= 0)
+        closeFile(out.file);
+      giveBuffer(out.data);
+      c.output.erase(c.output.begin());
+      c.output_sent = 0;
+    }
+    if (!c.output.empty())
+      return;
+
+    std::vector<TOutput>().swap(c.output);
+    activity.watch(s, !c.busy, false);
+    if (c.close_when_sent) {
+      closeClient(s);
+      return;
+    }
+    if (!c.busy)
+      touch(c);
+    // Continue with the requests received meanwhile
+    if (!c.partial.empty() && !c.busy) {
+      if (!processInput(s, nullptr, 0))
+        closeClient(s);
+    }
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::createWakeUp() {
+#if HTTP_HAS_EPOLL
+    wake_fds[0] = wake_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return wake_fds[0] >= 0;
+#elif !defined( _WIN32 )
+    if (pipe(wake_fds) != 0)
+      return false;
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+    return true;
+#else
+    // select in windows only takes sockets, so a pair connected through
+    // a listener in the loopback, which is closed once they are connected
+    TSocket listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET)
+      return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    bool ok = bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0
+      && listen(listener, 1) == 0
+      && getsockname(listener, (struct sockaddr*)&addr, &addr_len) == 0;
+    if (ok) {
+      wake_fds[1] = ::socket(AF_INET, SOCK_STREAM, 0);
+      ok = wake_fds[1] != INVALID_SOCKET && connect(wake_fds[1], (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+    if (ok) {
+      wake_fds[0] = ::accept(listener, nullptr, nullptr);
+      ok = wake_fds[0] != INVALID_SOCKET;
+    }
+    ::closesocket(listener);
+    if (!ok) {
+      printf("createWakeUp failed\n");
+      return false;
+    }
+    // Each wake up is a single byte, which must not wait for more
+    int on = 1;
+    setsockopt(wake_fds[1], IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    setNonBlocking(wake_fds[0]);
+    setNonBlocking(wake_fds[1]);
+    return true;
+#endif
+  }
+
+  // -------------------------------------------------------
+  // Bytes asked to each recv. Growing it costs nothing, as it's not zeroed
+  static const size_t recv_buffer_size = 16 * 1024;
+
+  bool CBaseServer::TReactor::prepare() {
+    inbuf.reserve(recv_buffer_size);
+    active_sockets.reserve(8);
+    active_sockets.push_back(server);
+
+    if (owner->num_workers > 0) {
+      answers.init(owner->max_queued_requests * 2);
+      if (!createWakeUp())
+        return false;
+    }
+
+#if HTTP_HAS_IO_URING
+    if (owner->engine == ENGINE_IO_URING) {
+      uring = new TURing;
+      if (uring->open(this))
+        return true;
+      if( owner->trace ) printf("http_server.io_uring not supported. Using the default engine\n");
+      uring->close();
+      delete uring;
+      uring = nullptr;
+    }
+#endif
+
+    bool want_epoll = (owner->engine == ENGINE_EPOLL || owner->engine == ENGINE_DEFAULT || owner->engine == ENGINE_IO_URING);
+    if (!activity.open(want_epoll))
+      return false;
+    if (!activity.add(server))
+      return false;
+    if (wake_fds[0] != INVALID_SOCKET) {
+      if (!activity.add(wake_fds[0]))
+        return false;
+      active_sockets.push_back(wake_fds[0]);
+    }
+    activity.ready_to_read.reserve(8);
+    return true;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::TReactor::open(CBaseServer* new_owner, int port, bool reuse_port) {
+    owner = new_owner;
+    if (!createServer(port, reuse_port))
+      return false;
+    return prepare();
   }
 
   // -------------------------------------------------------
   // Close all pending connections
+  void CBaseServer::TReactor::close() {
+    // The wake up fd is only watched by select/epoll
+    if (wake_fds[0] != INVALID_SOCKET && !uring)
+      active_sockets.detach(wake_fds[0]);
+#if HTTP_HAS_IO_URING
+    // Closing the ring cancels all the requests in flight
+    if (uring) {
+      uring->close();
+      delete uring;
+      uring = nullptr;
+    }
+#endif
+    // The ones waiting for a worker are no longer in active_sockets
+    for (auto& it : connections) {
+      dropOutput(it.second);
+      if (it.second.closing)
+        ::closesocket(it.first);
+    }
+    connections.clear();
+    oldest = newest = nullptr;
+    while (!active_sockets.empty())
+      closeClient(active_sockets[0]);
+    activity.close();
+
+    if (wake_fds[0] != INVALID_SOCKET)
+      ::closesocket(wake_fds[0]);
+    if (wake_fds[1] != INVALID_SOCKET && wake_fds[1] != wake_fds[0])
+      ::closesocket(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = INVALID_SOCKET;
+
+    TAnswer* answer;
+    while (answers.pop(answer))
+      owner->dropAnswer(answer);
+    for (auto job : parked)
+      owner->freeJob(job);
+    parked.clear();
+  }
+
+  // -------------------------------------------------------
+  // This will block for timeout_usecs at most. 0 just to poll
+  bool CBaseServer::TReactor::tick(unsigned timeout_usecs) {
+    bool activity_found = false;
+#if HTTP_HAS_IO_URING
+    if (uring) {
+      activity_found = uring->tick(timeout_usecs);
+    }
+    else
+#endif
+    if (activity.wait(active_sockets, timeout_usecs)) {
+      updateClock();
+      activity_found = true;
+      for (auto s : activity.ready_to_write)
+        flushOutput(s);
+      for (auto s : activity.ready_to_read) {
+        if (s == server) {
+          acceptNewClient();
+        }
+        else if (s == wake_fds[0]) {
+          // Answers are collected below
+          char tmp[64];
+#if defined( _WIN32 )
+          while (::recv(s, tmp, (int)sizeof(tmp), 0) > 0) { }
+#else
+          while (::read(s, tmp, sizeof(tmp)) > 0) { }
+#endif
+        }
+        else if (!inbuf.recv(s) || !processInput(s, inbuf.data(), inbuf.size())) {
+          closeClient(s);
+        }
+      }
+    }
+
+    if (owner->workers_running)
+      drainAnswers();
+    updateClock();
+    closeIdleClients();
+    return activity_found;
+  }
+
+  // -------------------------------------------------------
+  // Pools of jobs & answers, reused to avoid allocations
+  CBaseServer::TJob* CBaseServer::newJob() {
+    TJob* job;
+    if (free_jobs.pop(job))
+      return job;
+    return new TJob;
+  }
+
+  void CBaseServer::freeJob(TJob* job) {
+    job->request = TRequest();
+    if (!free_jobs.push(job))
+      delete job;
+  }
+
+  CBaseServer::TAnswer* CBaseServer::newAnswer() {
+    TAnswer* answer;
+    if (free_answers.pop(answer))
+      return answer;
+    return new TAnswer;
+  }
+
+  void CBaseServer::freeAnswer(TAnswer* answer) {
+    answer->shared.reset();
+    if (!free_answers.push(answer))
+      delete answer;
+  }
+
+  // An answer which will not be sent, with the request it ends, if any
+  void CBaseServer::dropAnswer(TAnswer* answer) {
+    if (answer->file >= 0)
+      closeFile(answer->file);
+    answer->file = -1;
+    if (answer->done)
+      freeJob(answer->done);
+    answer->done = nullptr;
+    freeAnswer(answer);
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::runWorker() {
+    while (!stopping) {
+      TJob* job;
+      if (!jobs.pop(job)) {
+        std::unique_lock<std::mutex> lock(workers_mutex);
+        workers_sleeping++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (jobs.size() == 0 && !stopping)
+          workers_cv.wait_for(lock, std::chrono::milliseconds(100));
+        workers_sleeping--;
+        continue;
+      }
+
+      auto wait = std::chrono::steady_clock::now() - job->queued_at;
+      uint64_t wait_usecs = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+      stats_requests++;
+      stats_total_wait_usecs += wait_usecs;
+      uint64_t max_wait = stats_max_wait_usecs;
+      while (wait_usecs > max_wait && !stats_max_wait_usecs.compare_exchange_weak(max_wait, wait_usecs)) { }
+
+      bool keep = callHandler(job->request);
+
+      // The last answer, if any, tells the request is done
+      TAnswer* answer = heldAnswer();
+      heldAnswer() = nullptr;
+      if (answer && (answer->client != job->request.client || answer->reactor != job->request.reactor)) {
+        answer->reactor->post(answer);
+        answer = nullptr;
+      }
+      if (!answer) {
+        answer = newAnswer();
+        answer->header.clear();
+        answer->body.clear();
+      }
+      answer->client = job->request.client;
+      answer->done = job;
+      answer->keep = keep;
+      job->request.reactor->post(answer);
+    }
+  }
+
+  // -------------------------------------------------------
+  // Runs onClientRequest with the arena of this thread, and releases
+  // all of it once the answer is out of the handler
+  bool CBaseServer::callHandler(TRequest& r) {
+    static thread_local CArena arena;
+    arena.block_size = arena_block_size;
+    r.arena = &arena;
+    bool keep = onClientRequest(r) && r.keep_alive;
+    r.arena = nullptr;
+
+    size_t used = arena.used();
+    size_t max_used = stats_arena_max_used.load(std::memory_order_relaxed);
+    while (used > max_used && !stats_arena_max_used.compare_exchange_weak(max_used, used)) { }
+    if (arena.blocksUsed() > 1)
+      stats_arena_overflows++;
+    arena.reset();
+    return keep;
+  }
+
+  CBaseServer::TArenaStats CBaseServer::getArenaStats() const {
+    TArenaStats stats;
+    stats.max_used = stats_arena_max_used;
+    stats.overflows = stats_arena_overflows;
+    return stats;
+  }
+
+  // -------------------------------------------------------
+  CBaseServer::TWorkerStats CBaseServer::getWorkerStats() const {
+    TWorkerStats stats;
+    stats.requests = stats_requests;
+    stats.avg_wait_usecs = stats.requests ? stats_total_wait_usecs / stats.requests : 0;
+    stats.max_wait_usecs = stats_max_wait_usecs;
+    stats.queue_depth = jobs.size();
+    stats.max_queue_depth = stats_max_queue_depth;
+    return stats;
+  }
+
+  // -------------------------------------------------------
+  CBaseServer::CBaseServer()
+    : running(false)
+    , workers_running(false)
+    , stopping(false)
+    , workers_sleeping(0)
+    , stats_requests(0)
+    , stats_total_wait_usecs(0)
+    , stats_max_wait_usecs(0)
+    , stats_max_queue_depth(0)
+    , stats_arena_max_used(0)
+    , stats_arena_overflows(0)
+  {
+  }
+
+  // -------------------------------------------------------
+  CBaseServer::~CBaseServer() {
+    close();
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::open(int port, int nthreads) {
+    stopping = false;
+    if (nthreads < 1)
+      nthreads = 1;
+#if !defined( SO_REUSEPORT )
+    nthreads = 1;
+#endif
+    for (int i = 0; i < nthreads; ++i) {
+      auto reactor = new TReactor;
+      reactors.push_back(reactor);
+      if (!reactor->open(this, port, nthreads > 1)) {
+        close();
+        return false;
+      }
+    }
+
+    if (num_workers > 0) {
+      jobs.init(max_queued_requests);
+      free_jobs.init(max_queued_requests);
+      free_answers.init(max_queued_requests * 2);
+      workers_running = true;
+      for (int i = 0; i < num_workers; ++i)
+        workers.emplace_back([this]() { runWorker(); });
+    }
+
+    if (nthreads > 1) {
+      running = true;
+      for (auto reactor : reactors) {
+        reactor->thread = std::thread([this, reactor]() {
+          while (running)
+            reactor->tick(100000);
+        });
+      }
+    }
+    return true;
+  }
+
+  // -------------------------------------------------------
   void CBaseServer::close() {
-    while (!active_sockets.empty())
-      active_sockets.remove(active_sockets[0]);
+    // Workers posting to a reactor which no longer drains its answers
+    // drop them instead of waiting
+    stopping = true;
+    running = false;
+    for (auto reactor : reactors) {
+      if (reactor->thread.joinable())
+        reactor->thread.join();
+    }
+
+    // The workers finish the request they are running, and are joined
+    // before the reactors they answer to are gone
+    bool had_workers = workers_running;
+    if (had_workers) {
+      {
+        std::lock_guard<std::mutex> lock(workers_mutex);
+        workers_cv.notify_all();
+      }
+      for (auto& worker : workers)
+        worker.join();
+      workers.clear();
+      workers_running = false;
+    }
+
+    // The answers not collected give their jobs back to the pools
+    for (auto reactor : reactors) {
+      reactor->close();
+      delete reactor;
+    }
+    reactors.clear();
+
+    if (had_workers) {
+      TJob* job;
+      while (jobs.pop(job))
+        delete job;
+      while (free_jobs.pop(job))
+        delete job;
+      TAnswer* answer;
+      while (free_answers.pop(answer))
+        delete answer;
+    }
   }
 
   // -------------------------------------------------------
   // This will block for timeout_usecs at most. 0 just to poll
   bool CBaseServer::tick(unsigned timeout_usecs) {
-    if (!activity.wait(active_sockets, timeout_usecs))
+    // The reactor threads are doing the work
+    if (running) {
+      std::this_thread::sleep_for(std::chrono::microseconds(timeout_usecs));
+      return false;
+    }
+    if (reactors.empty())
+      return false;
+    return reactors[0]->tick(timeout_usecs);
+  }
+
+  // -------------------------------------------------------
+  static void appendText(VBytes& buf, TStringView text) {
+    buf.insert(buf.end(), text.begin(), text.end());
+  }
+
+  // Writes the digits backwards, ending at end. Returns where they start
+  static char* formatNumber(char* end, uint64_t value) {
+    do {
+      *--end = (char)('0' + value % 10);
+      value /= 10;
+    } while (value);
+    return end;
+  }
+
+  static char* formatTwoDigits(char* p, int value) {
+    p[0] = (char)('0' + value / 10);
+    p[1] = (char)('0' + value % 10);
+    return p + 2;
+  }
+
+  // 'Sun, 06 Nov 1994 08:49:37 GMT', the 29 chars of an http date
+  static const size_t http_date_size = 29;
+  static void formatHttpDate(char* p, time_t raw_time) {
+    // Reactors may run in several threads, so skip the static buffer of gmtime
+    struct tm t;
+#if defined( _WIN32 )
+    gmtime_s(&t, &raw_time);
+#else
+    gmtime_r(&raw_time, &t);
+#endif
+    // Not strftime, which follows the locale
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    memcpy(p, days + 3 * t.tm_wday, 3);
+    memcpy(p + 3, ", ", 2);
+    p = formatTwoDigits(p + 5, t.tm_mday);
+    *p++ = ' ';
+    memcpy(p, months + 3 * t.tm_mon, 3);
+    p[3] = ' ';
+    int year = t.tm_year + 1900;
+    p = formatTwoDigits(p + 4, year / 100);
+    p = formatTwoDigits(p, year % 100);
+    *p++ = ' ';
+    p = formatTwoDigits(p, t.tm_hour);
+    *p++ = ':';
+    p = formatTwoDigits(p, t.tm_min);
+    *p++ = ':';
+    p = formatTwoDigits(p, t.tm_sec);
+    memcpy(p, " GMT", 4);
+  }
+
+  // Days since 1970-01-01 (H. Hinnant)
+  static int64_t daysFromCivil(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+  }
+
+  static bool parseDigits(const char* p, int n, int& value) {
+    value = 0;
+    for (int i = 0; i < n; ++i) {
+      if (p[i] < '0' || p[i] > '9')
+        return false;
+      value = value * 10 + (p[i] - '0');
+    }
+    return true;
+  }
+
+  // Only the format we send. The obsolete ones sent by old clients
+  // return false, and they get the full answer
+  static bool parseHttpDate(const char* text, time_t& value) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (strlen(text) < http_date_size || text[3] != ',' || memcmp(text + 25, " GMT", 4) != 0)
       return false;
+    int month = 0;
+    while (month < 12 && memcmp(months + 3 * month, text + 8, 3) != 0)
+      ++month;
+    int day, year, hour, min, sec;
+    if (month == 12 || !parseDigits(text + 5, 2, day) || !parseDigits(text + 12, 4, year)
+      || !parseDigits(text + 17, 2, hour) || !parseDigits(text + 20, 2, min) || !parseDigits(text + 23, 2, sec))
+      return false;
+    int64_t days = daysFromCivil(year, month + 1, day);
+    value = (time_t)(((days * 24 + hour) * 60 + min) * 60 + sec);
+    return true;
+  }
+
+  // 'Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n'. Each thread formats it
+  // again only when the second changes
+  static TStringView dateHeader() {
+    struct TDate {
+      time_t at = 0;
+      char   line[40];
+    };
+    static thread_local TDate date;
+    static const size_t line_size = 6 + http_date_size + 2;
+    time_t raw_time = time(nullptr);
+    if (raw_time != date.at) {
+      memcpy(date.line, "Date: ", 6);
+      formatHttpDate(date.line + 6, raw_time);
+      memcpy(date.line + 6 + http_date_size, "\r\n", 2);
+      date.at = raw_time;
+    }
+    return TStringView(date.line, line_size);
+  }
+
+  // The headers telling the encoding. Known ones come ready, others are
+  // formatted in buf. null without an encoding
+  static const char* encodingHeader(const char* encoding, char* buf, size_t size) {
+    if (!encoding)
+      return nullptr;
+    if (strcmp(encoding, "gzip") == 0)
+      return "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+    if (strcmp(encoding, "deflate") == 0)
+      return "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n";
+    if (strcmp(encoding, "br") == 0)
+      return "Content-Encoding: br\r\nVary: Accept-Encoding\r\n";
+    snprintf(buf, size, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", encoding);
+    return buf;
+  }
+
+  // -------------------------------------------------------
+  // Extra header lines of an answer. Lines that don't fit are dropped.
+  // Keeps the validators of the content for the conditional requests
+  struct CBaseServer::TExtraHeaders {
+    char        text[256];
+    size_t      size = 0;
+    TStringView etag;               // Inside text, quoted
+    time_t      mtime = 0;
+
+    void add(TStringView lines) {
+      if (lines.empty() || lines.size > sizeof(text) - size)
+        return;
+      memcpy(text + size, lines.data, lines.size);
+      size += lines.size;
+    }
 
-    for (auto s : activity.ready_to_read) {
-      if (s == server) {
-        auto client = acceptNewClient();
-        active_sockets.emplace_back(client);
+    // Strong for the content as it is. Weak when encoded, as the bytes
+    // depend on the compression level
+    void setETag(uint64_t hash, const char* encoding) {
+      static const char hex[] = "0123456789abcdef";
+      char line[64];
+      memcpy(line, "ETag: ", 6);
+      char* p = line + 6;
+      if (encoding) {
+        memcpy(p, "W/", 2);
+        p += 2;
       }
-      else {
-        if (!inbuf.recv(s)) {
-          active_sockets.remove(s);
-        }
-        else {
-          TRequest r;
-          r.client = s;
-          if (r.parse(inbuf, trace)) {
-            if (!onClientRequest(r))
-              active_sockets.remove(s);
-          }
-        }
+      *p++ = '"';
+      for (int i = 15; i >= 0; --i)
+        *p++ = hex[(hash >> (4 * i)) & 15];
+      if (encoding) {
+        size_t n = std::min(strlen(encoding), (size_t)16);
+        *p++ = '-';
+        memcpy(p, encoding, n);
+        p += n;
       }
+      *p++ = '"';
+      size_t etag_size = p - line - 6;
+      memcpy(p, "\r\n", 2);
+      size_t at = size;
+      add(TStringView(line, p + 2 - line));
+      if (size > at)
+        etag = TStringView(text + at + 6, etag_size);
     }
 
-    return true;
+    void setLastModified(time_t new_mtime) {
+      char line[48];
+      memcpy(line, "Last-Modified: ", 15);
+      formatHttpDate(line + 15, new_mtime);
+      memcpy(line + 15 + http_date_size, "\r\n", 2);
+      add(TStringView(line, 15 + http_date_size + 2));
+      mtime = new_mtime;
+    }
+
+    TStringView view() const { return TStringView(text, size); }
+  };
+
+  // If-None-Match: "a", W/"b". Compared weakly, as the RFC asks for it
+  static bool etagMatches(const char* list, TStringView etag) {
+    if (etag.startsWith("W/"))
+      etag = etag.substr(2);
+    TStringView tags(list);
+    size_t pos = 0;
+    while (pos < tags.size) {
+      size_t end = tags.find(',', pos);
+      if (end == TStringView::npos)
+        end = tags.size;
+      TStringView tag = tags.substr(pos, end - pos);
+      while (!tag.empty() && (tag[0] == ' ' || tag[0] == '\t'))
+        tag = tag.substr(1);
+      while (!tag.empty() && (tag[tag.size - 1] == ' ' || tag[tag.size - 1] == '\t'))
+        tag.size--;
+      if (tag == "*")
+        return true;
+      if (tag.startsWith("W/"))
+        tag = tag.substr(2);
+      if (tag == etag)
+        return true;
+      pos = end + 1;
+    }
+    return false;
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::formatHeader(
+    VBytes& header, 
+    const TRequest& r, 
+    TStringView status, 
+    uint64_t content_length, 
+    const char* content_type, 
+    TStringView extra_headers
+  ) {
+
+    // Copied in place, without parsing a format
+    header.clear();
+    appendText(header, "HTTP/1.1 ");
+    appendText(header, status);
+    appendText(header, "\r\n");
+    // These never have a body. Unknown lengths are sent in chunks
+    bool no_body = status.startsWith("1") || status.startsWith("204") || status.startsWith("304");
+    if (no_body)
+      ;
+    else if (content_length == UINT64_MAX)
+      appendText(header, "Transfer-Encoding: chunked\r\n");
+    else {
+      appendText(header, "Content-Length: ");
+      char digits[24];
+      char* end = digits + sizeof(digits);
+      char* p = formatNumber(end, content_length);
+      header.insert(header.end(), p, end);
+      appendText(header, "\r\n");
+    }
+    if (content_type) {
+      appendText(header, "Content-Type: ");
+      appendText(header, content_type);
+      appendText(header, "\r\n");
+    }
+    appendText(header, dateHeader());
+    appendText(header, r.keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    appendText(header, extra_headers);
+    appendText(header, "\r\n");
+  }
+
+  // -------------------------------------------------------
+  void CBaseServer::TResponse::addHeader(TStringView title, TStringView value) {
+    appendText(headers, title);
+    appendText(headers, ": ");
+    appendText(headers, value);
+    appendText(headers, "\r\n");
+  }
+
+  void CBaseServer::TResponse::addHeader(TStringView title, uint64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = formatNumber(end, value);
+    addHeader(title, TStringView(p, end - p));
+  }
+
+  void CBaseServer::TResponse::setBody(const char* new_data, size_t new_size) {
+    body = BODY_DATA;
+    data = new_data;
+    size = new_size;
+  }
+
+  void CBaseServer::TResponse::setFile(int new_fd, uint64_t new_offset, uint64_t length) {
+    body = BODY_FILE;
+    fd = new_fd;
+    offset = new_offset;
+    size = length;
+  }
+
+  void CBaseServer::TResponse::setShared(const CFileCache::TFileRef& file) {
+    body = BODY_SHARED;
+    keep = file;
+    data = file->data;
+    size = file->size;
+  }
+
+  void CBaseServer::TResponse::setStream(std::function<size_t(char* buf, size_t size)> new_stream) {
+    body = BODY_STREAM;
+    stream = std::move(new_stream);
+  }
+
+  void CBaseServer::TResponse::clear() {
+    status = 200;
+    reason = nullptr;
+    content_type = nullptr;
+    headers.clear();
+    body = BODY_NONE;
+    data = nullptr;
+    size = 0;
+    fd = -1;
+    offset = 0;
+    keep.reset();
+    stream = nullptr;
+  }
+
+  const char* CBaseServer::TResponse::standardReason(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 412: return "Precondition Failed";
+    case 413: return "Payload Too Large";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    }
+    return "Unknown";
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::sendResponse( 
+    const TRequest& r,
+    const TResponse& response
+  ) {
+    // '404 Not Found'
+    const char* reason = response.reason ? response.reason : TResponse::standardReason(response.status);
+    int code = std::max(100, std::min(response.status, 999));
+    char status[64];
+    status[0] = (char)('0' + code / 100);
+    formatTwoDigits(status + 1, code % 100);
+    status[3] = ' ';
+    size_t reason_size = std::min(strlen(reason), sizeof(status) - 4);
+    memcpy(status + 4, reason, reason_size);
+    TStringView status_line(status, reason_size + 4);
+    TStringView headers(response.headers.data(), response.headers.size());
+
+    // 1xx, 204 and 304 never have a body, and anything sent after the
+    // header would be read as the next answer
+    bool no_body = code < 200 || code == 204 || code == 304;
+    bool head = r.method == TRequest::HEAD;
+
+    TPooledBytes header;
+    switch (no_body ? TResponse::BODY_NONE : response.body) {
+    case TResponse::BODY_NONE:
+      formatHeader(header, r, status_line, 0, response.content_type, headers);
+      return r.reactor->send(r.client, header, nullptr, 0);
+
+    case TResponse::BODY_DATA:
+      formatHeader(header, r, status_line, response.size, response.content_type, headers);
+      return r.reactor->send(r.client, header, response.data, head ? 0 : (size_t)response.size);
+
+    case TResponse::BODY_SHARED:
+      formatHeader(header, r, status_line, response.size, response.content_type, headers);
+      if (head)
+        return r.reactor->send(r.client, header, nullptr, 0);
+      return r.reactor->sendShared(r.client, header, response.keep, response.data, (size_t)response.size);
+
+    case TResponse::BODY_FILE: {
+      uint64_t file_size;
+      if (!getFileSize(response.fd, file_size) || response.offset > file_size)
+        return false;
+      uint64_t length = std::min(response.size, file_size - response.offset);
+      formatHeader(header, r, status_line, length, response.content_type, headers);
+      if (head)
+        return r.reactor->send(r.client, header, nullptr, 0);
+      // The answer may be sent after we return, so it gets its own fd
+      int file = dupFile(response.fd);
+      if (file < 0)
+        return false;
+      return r.reactor->sendFile(r.client, header, file, response.offset, length);
+    }
+
+    case TResponse::BODY_STREAM:
+      return sendStream(r, status_line, response);
+    }
+    return false;
+  }
+
+  // -------------------------------------------------------
+  // Each piece the stream gives goes out as a chunk. HTTP/1.0 clients
+  // don't know about chunks, so they get the body whole
+  bool CBaseServer::sendStream( 
+    const TRequest& r,
+    TStringView status,
+    const TResponse& response
+  ) {
+    static const size_t piece_size = 16 * 1024;
+    static const size_t prefix_size = 10;          // 8 hex digits + \r\n
+    TStringView headers(response.headers.data(), response.headers.size());
+    TPooledBytes header;
+
+    if( r.version != 11 ) {
+      TPooledBytes body;
+      size_t n;
+      do {
+        size_t old_size = body.size();
+        body.resize(old_size + piece_size);
+        n = std::min(response.stream(body.data() + old_size, piece_size), piece_size);
+        body.resize(old_size + n);
+      } while( n );
+      formatHeader(header, r, status, body.size(), response.content_type, headers);
+      return r.reactor->send(r.client, header, body.data(), r.method == TRequest::HEAD ? 0 : body.size());
+    }
+
+    formatHeader(header, r, status, UINT64_MAX, response.content_type, headers);
+    bool all_sent = r.reactor->send(r.client, header, nullptr, 0);
+    if( r.method == TRequest::HEAD )
+      return all_sent;
+
+    TPooledBytes chunk;
+    while( true ) {
+      chunk.resize(prefix_size + piece_size + 2);
+      size_t n = std::min(response.stream(chunk.data() + prefix_size, piece_size), piece_size);
+      if( !n )
+        break;
+      char prefix[prefix_size + 1];
+      snprintf( prefix, sizeof(prefix), "%08x\r\n", (unsigned)n );
+      memcpy( chunk.data(), prefix, prefix_size );
+      memcpy( chunk.data() + prefix_size + n, "\r\n", 2 );
+      chunk.resize(prefix_size + n + 2);
+      all_sent &= r.reactor->send(r.client, chunk, nullptr, 0);
+    }
+    static const char last_chunk[] = "0\r\n\r\n";
+    chunk.assign(last_chunk, last_chunk + sizeof(last_chunk) - 1);
+    all_sent &= r.reactor->send(r.client, chunk, nullptr, 0);
+    return all_sent;
   }
 
   // -------------------------------------------------------
-  void CBaseServer::sendAnswer( 
+  bool CBaseServer::sendAnswer( 
     const TRequest& r,
     const VBytes& answer_data, 
     const char* content_type, 
     const char* content_encoding 
   ) {
 
-    assert( content_type );
+    return sendBytes(r, answer_data.data(), answer_data.size(), content_type, content_encoding, TStringView());
+  }
 
-    time_t raw_time;
-    time(&raw_time);
-    struct tm* time_info = gmtime(&raw_time);
+  bool CBaseServer::sendAnswer( 
+    const TRequest& r,
+    const char* data, 
+    size_t size, 
+    const char* content_type, 
+    const char* content_encoding 
+  ) {
+    return sendBytes(r, data, size, content_type, content_encoding, TStringView());
+  }
 
+  // Like sendAnswer, with more header lines, like the validators
+  bool CBaseServer::sendBytes( 
+    const TRequest& r,
+    const char* data, 
+    size_t size, 
+    const char* content_type, 
+    const char* content_encoding,
+    TStringView more_headers
+  ) {
     // If the user specifies an encoding type, added the corresponding header answer
-    char extra_header[64];
-    if( content_encoding ) 
-      sprintf( extra_header, "Content-Encoding: %s\r\n", content_encoding );
-
-    // Format the full header
-    VBytes header;
-    header.format(
-      "HTTP/1.1 200 OK\r\n"
-      "Content-Length: %d\r\n"
-      "Content-Type: %s\r\n"
-      "Date: %s GMT\r\n"
-      "%s"
-      "\r\n"
-      , (int)answer_data.size()
-      , content_type
-      , asctime(time_info)
-      , content_encoding ? extra_header : ""
-      );
-    header.send(r.client);
-    answer_data.send(r.client);
-
-  }
-
-  // -------------------------------------------------------
-  void CBaseServer::compressAndSendAnswer( 
+    char encoding_header[96];
+    TExtraHeaders extra;
+    extra.add( encodingHeader( content_encoding, encoding_header, sizeof(encoding_header) ) );
+    extra.add( more_headers );
+
+    TPooledBytes header;
+    formatHeader(header, r, "200 OK", size, content_type, extra.view());
+    return r.reactor->send(r.client, header, data, r.method == TRequest::HEAD ? 0 : size);
+  }
+
+  // -------------------------------------------------------
+  // Answers 304 when the client has this content already. If-None-Match
+  // wins over If-Modified-Since when both are sent. sent is false when
+  // the 304 was queued, like the result of sendAnswer
+  bool CBaseServer::sendNotModified(const TRequest& r, const TExtraHeaders& validators, bool& sent) {
+    if (r.method != TRequest::GET && r.method != TRequest::HEAD)
+      return false;
+    bool not_modified;
+    const char* if_none_match = r.getHeader(TRequest::HEADER_IF_NONE_MATCH);
+    if (if_none_match)
+      not_modified = !validators.etag.empty() && etagMatches(if_none_match, validators.etag);
+    else {
+      const char* since = r.getHeader(TRequest::HEADER_IF_MODIFIED_SINCE);
+      time_t since_time;
+      not_modified = since && validators.mtime && parseHttpDate(since, since_time) && validators.mtime <= since_time;
+    }
+    if (!not_modified)
+      return false;
+
+    TPooledBytes header;
+    formatHeader(header, r, "304 Not Modified", 0, nullptr, validators.view());
+    sent = r.reactor->send(r.client, header, nullptr, 0);
+    return true;
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::sendFileAnswer( 
+    const TRequest& r,
+    const char* filename, 
+    const char* content_type, 
+    uint64_t offset, 
+    uint64_t length 
+  ) {
+    int fd = openFile(filename);
+    if (fd < 0) {
+      if( trace ) printf( "Can't open file %s\n", filename );
+      return false;
+    }
+    bool ok = sendFileAnswer(r, fd, content_type, offset, length);
+    closeFile(fd);
+    return ok;
+  }
+
+  bool CBaseServer::sendFileAnswer( 
+    const TRequest& r,
+    int fd, 
+    const char* content_type, 
+    uint64_t offset, 
+    uint64_t length 
+  ) {
+    uint64_t file_size;
+    time_t mtime = 0;
+    if (!getFileSize(fd, file_size, &mtime) || offset > file_size)
+      return false;
+    if (length > file_size - offset)
+      length = file_size - offset;
+    if (!length && file_size)
+      return false;
+
+    // Not read to hash it. Its size and mtime tell when it changes
+    uint64_t stamp[2] = { (uint64_t)mtime, file_size };
+    TExtraHeaders extra;
+    extra.setETag(hashBytes((const char*)stamp, sizeof(stamp)), nullptr);
+    extra.setLastModified(mtime);
+    bool sent;
+    if (sendNotModified(r, extra, sent))
+      return sent;
+
+    TPooledBytes header;
+    if (offset == 0 && length == file_size) {
+      formatHeader(header, r, "200 OK", length, content_type, extra.view());
+    }
+    else {
+      char range_header[96];
+      snprintf( range_header, sizeof(range_header), "Content-Range: bytes %llu-%llu/%llu\r\n"
+        , (unsigned long long)offset
+        , (unsigned long long)(offset + length - 1)
+        , (unsigned long long)file_size );
+      extra.add( range_header );
+      formatHeader(header, r, "206 Partial Content", length, content_type, extra.view());
+    }
+    if (r.method == TRequest::HEAD)
+      return r.reactor->send(r.client, header, nullptr, 0);
+
+    // The answer may be sent after we return, so it gets its own fd
+    int file = dupFile(fd);
+    if (file < 0)
+      return false;
+    return r.reactor->sendFile(r.client, header, file, offset, length);
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::sendAnswer( 
+    const TRequest& r,
+    const CFileCache::TFileRef& file, 
+    const char* content_type, 
+    const char* content_encoding 
+  ) {
+    TExtraHeaders extra;
+    extra.setETag(file->hash, nullptr);
+    extra.setLastModified(file->mtime);
+    bool sent;
+    if (sendNotModified(r, extra, sent))
+      return sent;
+
+    char encoding_header[96];
+    extra.add( encodingHeader( content_encoding, encoding_header, sizeof(encoding_header) ) );
+    TPooledBytes header;
+    formatHeader(header, r, "200 OK", file->size, content_type, extra.view());
+    if (r.method == TRequest::HEAD)
+      return r.reactor->send(r.client, header, nullptr, 0);
+    return r.reactor->sendShared(r.client, header, file, file->data, file->size);
+  }
+
+  bool CBaseServer::sendCachedFileAnswer( 
+    const TRequest& r,
+    const char* filename, 
+    const char* content_type
+  ) {
+    auto file = files.get(filename);
+    if (!file)
+      return sendFileAnswer(r, filename, content_type);
+    return sendAnswer(r, file, content_type);
+  }
+
+  // -------------------------------------------------------
+  // 0 when the answer should be sent without compression
+  int CBaseServer::compressionLevel( 
+    const VBytes& answer_data, 
+    const char* content_type
+  ) const {
+    const TCompressionPolicy& p = compression;
+    if( answer_data.size() < p.min_size )
+      return 0;
+
+    // Bodies already in gzip format
+    if( answer_data.size() >= 2 && (unsigned char)answer_data[0] == 0x1f && (unsigned char)answer_data[1] == 0x8b )
+      return 0;
+    for( auto& type : p.skip_types ) {
+      if( matchesType( content_type, type ) )
+        return 0;
+    }
+
+    int level = p.level;
+    for( auto& type_level : p.type_levels ) {
+      if( matchesType( content_type, type_level.first ) ) {
+        level = type_level.second;
+        break;
+      }
+    }
+
+    // When the workers can't keep up, trade ratio for latency
+    if( num_workers > 0 && p.busy_queue_depth && jobs.size() >= p.busy_queue_depth )
+      level = std::min( level, p.busy_level );
+
+    return std::max( 1, std::min( level, 9 ) );
+  }
+
+  // -------------------------------------------------------
+  bool CBaseServer::compressAndSendAnswer( 
     const TRequest& r,
     const VBytes& answer_data, 
     const char* content_type
   ) {
-    VBytes zans;
-    if( r.headerContains("Accept-Encoding", "deflate") && compress( answer_data, zans ) ) {
-      if( trace ) printf( "Compressing answer from %d to %d bytes\n", (int)answer_data.size(), (int)zans.size());
-      sendAnswer(r, zans, content_type, "deflate");
+    const char* encoding = chooseEncoding( r.getHeader(TRequest::HEADER_ACCEPT_ENCODING) );
+    int level = encoding ? compressionLevel( answer_data, content_type ) : 0;
+    if( !level )
+      encoding = nullptr;
+
+    // Tagged by its content, and by the encoding only when the answer
+    // goes out encoded. A client with either one already gets a 304
+    uint64_t hash = hashBytes(answer_data.data(), answer_data.size());
+    TExtraHeaders identity;
+    identity.setETag( hash, nullptr );
+    TExtraHeaders encoded;
+    if( level )
+      encoded.setETag( hash, encoding );
+    bool sent;
+    if( sendNotModified( r, identity, sent ) || (level && sendNotModified( r, encoded, sent )) )
+      return sent;
+    TStringView etag_line = identity.view();
+    TStringView encoded_etag_line = encoded.view();
+
+    if( !level )
+      return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, etag_line);
+
+    if( !compressed.max_bytes && r.version == 11 && answer_data.size() >= stream_compression_min_size )
+      return sendCompressedChunks(r, answer_data, content_type, encoding, level, etag_line, encoded_etag_line);
+
+    if( !compressed.max_bytes ) {
+      TPooledBytes zans;
+      if( !compressAs( encoding, level, answer_data, zans ) )
+        return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, etag_line);
+      if( trace ) printf( "Compressing answer from %d to %d bytes (%s, level %d)\n", (int)answer_data.size(), (int)zans.size(), encoding, level);
+      // Data that does not compress is sent as it is
+      if( zans.size() >= answer_data.size() )
+        return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, etag_line);
+      return sendBytes(r, zans.data(), zans.size(), content_type, encoding, encoded_etag_line);
+    }
+
+    // Reuse the compressed bytes while the content does not change
+    auto zans = compressed.get(r.url, encoding, level, hash, answer_data.size());
+    if( !zans ) {
+      auto fresh = std::make_shared<VBytes>();
+      if( !compressAs( encoding, level, answer_data, *fresh ) )
+        return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, etag_line);
+      if( trace ) printf( "Compressing answer from %d to %d bytes (%s, level %d)\n", (int)answer_data.size(), (int)fresh->size(), encoding, level);
+      // Data that does not compress is remembered with no bytes
+      if( fresh->size() >= answer_data.size() )
+        fresh->clear();
+      compressed.add(r.url, encoding, level, hash, answer_data.size(), fresh);
+      zans = fresh;
+    }
+    if( zans->empty() )
+      return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, etag_line);
+
+    char encoding_header[96];
+    TExtraHeaders extra;
+    extra.add( encodingHeader( encoding, encoding_header, sizeof(encoding_header) ) );
+    extra.add( encoded_etag_line );
+    TPooledBytes header;
+    formatHeader(header, r, "200 OK", zans->size(), content_type, extra.view());
+    if( r.method == TRequest::HEAD )
+      return r.reactor->send(r.client, header, nullptr, 0);
+    return r.reactor->sendShared(r.client, header, zans, zans->data(), zans->size());
+  }
+
+  // -------------------------------------------------------
+  // Each compressed block goes out as a chunk as soon as tdefl produces
+  // it, instead of waiting for the whole answer to be compressed
+  bool CBaseServer::sendCompressedChunks( 
+    const TRequest& r,
+    const VBytes& answer_data, 
+    const char* content_type,
+    const char* encoding,
+    int level,
+    TStringView identity_headers,
+    TStringView more_headers
+  ) {
+    static const size_t piece_size = 64 * 1024;
+    static const size_t prefix_size = 10;          // 8 hex digits + \r\n
+    static const VBytes no_body;
+
+    // Leading zeros in the chunk size are valid, so the prefix is reserved
+    // before compressing into the chunk
+    TPooledBytes chunk;
+    chunk.resize(prefix_size);
+    TCompressStream z;
+    if( !z.begin( strcmp(encoding, "gzip") == 0, level, chunk ) )
+      return sendBytes(r, answer_data.data(), answer_data.size(), content_type, nullptr, identity_headers);
+
+    char encoding_header[96];
+    TExtraHeaders extra;
+    extra.add( encodingHeader( encoding, encoding_header, sizeof(encoding_header) ) );
+    extra.add( more_headers );
+    TPooledBytes header;
+    formatHeader(header, r, "200 OK", UINT64_MAX, content_type, extra.view());
+    bool all_sent = r.reactor->send(r.client, header, no_body);
+    if( r.method == TRequest::HEAD )
+      return all_sent;
+
+    size_t offset = 0;
+    size_t total_out = 0;
+    bool finish = false;
+    while( !finish ) {
+      size_t n = std::min(piece_size, answer_data.size() - offset);
+      finish = offset + n == answer_data.size();
+      if( !z.feed( answer_data.data() + offset, n, finish, chunk ) ) {
+        // The header is gone. Closing is the only way to tell the client
+        if( trace ) printf( "Compression failed for client %d\n", (int)r.client );
+        shutdownSocket(r.client);
+        return false;
+      }
+      offset += n;
+      size_t payload = chunk.size() - prefix_size;
+      if( !payload )
+        continue;
+      total_out += payload;
+      char prefix[prefix_size + 1];
+      snprintf( prefix, sizeof(prefix), "%08x\r\n", (unsigned)payload );
+      memcpy( chunk.data(), prefix, prefix_size );
+      static const char crlf[] = "\r\n";
+      static const char last_chunk[] = "\r\n0\r\n\r\n";
+      if( finish )
+        chunk.insert( chunk.end(), last_chunk, last_chunk + sizeof(last_chunk) - 1 );
+      else
+        chunk.insert( chunk.end(), crlf, crlf + 2 );
+      all_sent &= r.reactor->send(r.client, chunk, no_body);
+      chunk.resize(prefix_size);
     }
-    else
-      sendAnswer(r, answer_data, content_type );
+    if( trace ) printf( "Compressing answer from %d to %d bytes in chunks (%s)\n", (int)answer_data.size(), (int)total_out, encoding);
+    return all_sent;
   }
 
   // -------------------------------------------------------
@@ -14,31 +14,247 @@ typedef int socklen_t;
 #include <netinet/in.h>
 typedef int    TSocket;
 #define closesocket  close
+#define INVALID_SOCKET  (-1)
 
 #endif
 
+// epoll is available as activity backend on linux
+#if defined( __linux__ )
+#define HTTP_HAS_EPOLL 1
+#include <sys/epoll.h>
+// Define DISABLE_IO_URING_SUPPORT to discard the io_uring engine. It also
+// needs the kernel headers to have it, or only epoll and select are built
+#if !DISABLE_IO_URING_SUPPORT && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#define HTTP_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
 #include <vector>
 #include <sys/types.h> 
 #include <ctime>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <list>
+#include <functional>
+#include <cstring>
+#include <cstddef>
+#include <utility>
 
 namespace HTTP {
 
 // -------------------------------------------------------
-struct VBytes : public std::vector<char> {
+// Grows without zeroing the new bytes, which are about to be
+// overwritten by a recv, a vsnprintf or a copy anyway
+template< typename T >
+struct TNoInitAllocator : public std::allocator<T> {
+  template< typename U > struct rebind { typedef TNoInitAllocator<U> other; };
+  TNoInitAllocator() = default;
+  template< typename U > TNoInitAllocator(const TNoInitAllocator<U>&) {}
+  template< typename U > void construct(U* p) { ::new((void*)p) U; }
+  template< typename U, typename... Args > void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+};
+
+// -------------------------------------------------------
+struct VBytes : public std::vector<char, TNoInitAllocator<char>> {
   bool send(TSocket fd) const;
   bool recv(TSocket fd);
   void format(const char* fmt, ...);
   bool read(const char* file);
 };
 
+// -------------------------------------------------------
+// Bytes owned by someone else, like the request pointing inside the
+// buffer it was received in. Only valid while that buffer is
+struct TStringView {
+  const char* data = nullptr;
+  size_t      size = 0;
+
+  static const size_t npos = (size_t)-1;
+
+  TStringView() = default;
+  TStringView(const char* new_data, size_t new_size) : data(new_data), size(new_size) {}
+  TStringView(const char* text) : data(text), size(text ? strlen(text) : 0) {}
+  TStringView(const std::string& text) : data(text.data()), size(text.size()) {}
+
+  bool        empty() const { return size == 0; }
+  const char* begin() const { return data; }
+  const char* end() const { return data + size; }
+  char        operator[](size_t idx) const { return data[idx]; }
+  size_t      find(char c, size_t from = 0) const;
+  TStringView substr(size_t from, size_t n = npos) const;
+  bool        startsWith(TStringView prefix) const;
+  std::string str() const { return std::string(data, size); }
+  operator std::string() const { return str(); }
+};
+bool operator==(TStringView a, TStringView b);
+inline bool operator==(TStringView a, const char* b) { return a == TStringView(b); }
+inline bool operator!=(TStringView a, TStringView b) { return !(a == b); }
+inline bool operator!=(TStringView a, const char* b) { return !(a == b); }
+
+// -------------------------------------------------------
+// Bump pointer memory for the handler of a request, in r.arena. Nothing
+// is freed until reset, after onClientRequest returns. Blocks come from
+// the heap, as does the list holding them, which grows with each new
+// block. reset keeps the blocks of block_size for the next requests of
+// the thread, and frees the larger ones
+class CArena {
+public:
+  size_t block_size = 16 * 1024;    // Larger allocations get a block of their own
+
+  CArena() = default;
+  CArena(const CArena&) = delete;
+  CArena& operator=(const CArena&) = delete;
+  ~CArena();
+
+  // align up to alignof(std::max_align_t)
+  void*  alloc(size_t size, size_t align = alignof(std::max_align_t));
+  // Only the last allocation is given back, so a growing buffer reuses it
+  void   free(void* p, size_t size);
+  void   reset();
+  size_t used() const { return used_before + offset; }     // Since the last reset
+  size_t blocksUsed() const { return current + 1; }
+
+private:
+  struct TBlock {
+    char*  data;
+    size_t size;
+  };
+  std::vector<TBlock> blocks;
+  size_t current = 0;               // The one we are allocating from
+  size_t offset = 0;                // In the current block
+  size_t used_before = 0;           // In the blocks before it
+};
+
+template< typename T >
+struct TArenaAllocator {
+  typedef T value_type;
+  template< typename U > struct rebind { typedef TArenaAllocator<U> other; };
+  CArena* arena;
+  TArenaAllocator(CArena* new_arena) : arena(new_arena) {}
+  template< typename U > TArenaAllocator(const TArenaAllocator<U>& other) : arena(other.arena) {}
+  T*   allocate(size_t n) { return (T*)arena->alloc(n * sizeof(T), alignof(T)); }
+  void deallocate(T* p, size_t n) { arena->free(p, n * sizeof(T)); }
+  // Grows without zeroing, like VBytes
+  template< typename U > void construct(U* p) { ::new((void*)p) U; }
+  template< typename U, typename... Args > void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+};
+template< typename T, typename U >
+bool operator==(const TArenaAllocator<T>& a, const TArenaAllocator<U>& b) { return a.arena == b.arena; }
+template< typename T, typename U >
+bool operator!=(const TArenaAllocator<T>& a, const TArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+// Builds an answer in the arena. Send it with sendAnswer(r, b.data(), b.size(), ...)
+struct TArenaBytes : public std::vector<char, TArenaAllocator<char>> {
+  TArenaBytes(CArena* arena) : std::vector<char, TArenaAllocator<char>>(TArenaAllocator<char>(arena)) {}
+  TArenaBytes& append(const char* text, size_t n) { insert(end(), text, text + n); return *this; }
+  TArenaBytes& append(TStringView text) { return append(text.data, text.size); }
+  TArenaBytes& format(const char* fmt, ...);    // Appended, printf style
+  TStringView  view() const { return TStringView(data(), size()); }
+};
+
+// -------------------------------------------------------
+// Files mapped in memory on first use and shared by all the threads.
+// Changes are detected with a stat, at most every check_interval_secs.
+// The least recently used are unmapped when above max_bytes, once the
+// answers still sending them are done
+class CFileCache {
+public:
+
+  struct TFile {
+    const char* data = nullptr;
+    size_t      size = 0;
+    time_t      mtime = 0;
+    uint64_t    inode = 0;
+    uint64_t    hash = 0;             // Of the content, for its ETag
+    void*       mapping = nullptr;    // Or a heap copy where mmap is not available
+    ~TFile();
+  };
+  typedef std::shared_ptr<const TFile> TFileRef;
+
+  // nullptr when the file can't be read or is larger than max_file_size
+  TFileRef get(const char* filename);
+  void     clear();
+
+  size_t   max_bytes = 64 * 1024 * 1024;
+  size_t   max_file_size = 16 * 1024 * 1024;
+  unsigned check_interval_secs = 1;
+
+private:
+  struct TEntry {
+    std::string path;
+    TFileRef    file;
+    uint32_t    checked_at;           // In seconds
+  };
+  typedef std::list<TEntry> VEntries;
+  std::mutex  mutex;
+  VEntries    lru;                    // Most recently used first
+  std::unordered_map<std::string, VEntries::iterator> entries;
+  size_t      bytes = 0;
+  void        erase(VEntries::iterator it);
+};
+
+// -------------------------------------------------------
+// Compressed answers, so the same content is not compressed again.
+// One entry per url, encoding and level, valid while the hash and size
+// of the content match. Content which does not shrink is kept with no
+// bytes, so it is sent as it is without trying again. Disabled while
+// max_bytes is 0
+class CCompressedCache {
+public:
+  typedef std::shared_ptr<const VBytes> TDataRef;
+
+  TDataRef get(TStringView url, const char* encoding, int level, uint64_t hash, size_t size);
+  void     add(TStringView url, const char* encoding, int level, uint64_t hash, size_t size, const TDataRef& data);
+  void     clear();
+
+  size_t   max_bytes = 0;
+
+  struct TStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_saved;       // Uncompressed bytes the hits did not have to compress
+    size_t   bytes;             // Compressed bytes held now
+    size_t   entries;
+  };
+  TStats getStats() const;
+
+private:
+  struct TEntry {
+    std::string key;
+    uint64_t    hash;
+    size_t      size;
+    TDataRef    data;
+  };
+  typedef std::list<TEntry> VEntries;
+  mutable std::mutex mutex;
+  VEntries    lru;                    // Most recently used first
+  std::unordered_map<std::string, VEntries::iterator> entries;
+  size_t      bytes = 0;
+  uint64_t    hits = 0;
+  uint64_t    misses = 0;
+  uint64_t    bytes_saved = 0;
+  void        erase(VEntries::iterator it);
+};
+
 class CBaseServer {
   
   class VSockets : public std::vector<TSocket> {
   public:
     void remove(TSocket s);
+    void detach(TSocket s);       // Like remove, but without closing it
   };
 
+  struct TReactor;
+
 public:
 
   // -------------------------------------------------------
@@ -49,70 +265,549 @@ public:
       const char* value;    // 'curl/7.53.0'
     };
 
-    // only supporting GET
-    enum eMethod { GET, UNSUPPORTED };
+    // DEL because DELETE is a macro in windows. HEAD is answered like GET,
+    // and the send functions leave the body out
+    enum eMethod { GET, POST, PUT, PATCH, DEL, HEAD, UNSUPPORTED };
     eMethod     method;
 
-    // / or /index.html...
-    std::string url;
+    // / or /index.html?id=23. Zero terminated, and split in path and
+    // query. All of them point inside the buffer the request came in
+    TStringView url;
+    TStringView path;           // /index.html
+    TStringView query;          // id=23
+
+    // HTTP/1.1 keeps the connection open unless 'Connection: close' is
+    // sent. HTTP/1.0 only with 'Connection: keep-alive'. Also false when
+    // the client reached max_requests_per_connection. onClientRequest can
+    // clear it before sending the answer, which then says 'Connection: close'
+    int         version = 11;     // 10 or 11
+    mutable bool keep_alive = true;
     
+    // Well known headers, found without comparing strings
+    enum eHeader {
+      HEADER_HOST, HEADER_CONNECTION, HEADER_ACCEPT, HEADER_ACCEPT_ENCODING,
+      HEADER_USER_AGENT, HEADER_RANGE, HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE,
+      HEADER_CONTENT_LENGTH, HEADER_CONTENT_TYPE, HEADER_CONTENT_ENCODING,
+      HEADER_TRANSFER_ENCODING, HEADER_EXPECT, HEADER_COOKIE,
+      HEADER_COUNT, HEADER_OTHER = HEADER_COUNT
+    };
+    static eHeader headerId( const char* title, size_t len );
+
     // Save header lines
     static const int max_header_lines = 64;
     THeaderLine lines[max_header_lines];
     int         nlines = 0;
+    const char* known[HEADER_COUNT] = {};   // First value of each well known header, or null
+    const char* getHeader( eHeader id ) const { return known[id]; }
+    // Titles are case insensitive
     const char* getHeader( const char* title ) const;
     bool headerContains(const char* title, const char* text_in_header) const;
-    std::string getURIParam( const char* title ) const;
-    std::string getURLPath() const;
+    TStringView getURLPath() const { return path; }
+
+    // The query split in params, with the %XX and + escapes decoded
+    struct TParam {
+      TStringView name;
+      TStringView value;
+    };
+    static const int max_query_params = 32;
+    TParam      params[max_query_params];
+    int         nparams = 0;
+    // Value of a query param, empty when missing. The first one when repeated
+    TStringView getURIParam( const char* title ) const;
+
+    // The body, if any, is passed to onClientBody as it arrives, and
+    // onClientRequest is called once it is complete
+    uint64_t    content_length = 0;
+    bool        chunked = false;
+    uint64_t    body_size = 0;            // Received so far
+    bool        hasBody() const { return chunked || content_length > 0; }
 
+    // Parses a single request in place. The lines point inside data.
+    // keep_alive is false when a bad request leaves the connection unusable
+    bool parse(char* data, size_t size, bool trace);
     bool parse(VBytes& buf, bool trace);
 
     // Who has generated the request
     TSocket     client;
+    TReactor*   reactor = nullptr;
+
+    // Scratch memory for onClientRequest, released when it returns.
+    // Answers built in it are copied if they can't be sent right away
+    CArena*     arena = nullptr;
+
+  private:
+    uint8_t     param_slots[2 * max_query_params] = {};  // params + 1 by the hash of their name
+    std::string decoded;          // Only used by params with escapes
+    void        parseQuery();
+    TStringView decode(TStringView text);
+  };
+
+  // -------------------------------------------------------
+  // Any status, your own headers and where the body comes from. Sent
+  // with sendResponse. clear() keeps the buffers, to reuse it
+  struct TResponse {
+    int          status = 200;
+    const char*  reason = nullptr;          // The standard one for the status when null
+    const char*  content_type = nullptr;    // No Content-Type when null
+    VBytes       headers;                   // 'Title: value\r\n' lines, from addHeader
+
+    enum eBody { BODY_NONE, BODY_DATA, BODY_FILE, BODY_SHARED, BODY_STREAM };
+    eBody        body = BODY_NONE;      // Ignored for 1xx, 204 and 304, which have none
+    const char*  data = nullptr;            // DATA and SHARED
+    uint64_t     size = 0;
+    int          fd = -1;                   // FILE, a range of it. Not closed
+    uint64_t     offset = 0;
+    std::shared_ptr<const void> keep;       // SHARED, keeps data alive until sent
+    // STREAM, sent in chunks. Fills buf and returns the bytes written, 0 at the end
+    std::function<size_t(char* buf, size_t size)> stream;
+
+    void addHeader(TStringView title, TStringView value);
+    void addHeader(TStringView title, uint64_t value);
+    // Copied when it can't be sent right away
+    void setBody(const char* new_data, size_t new_size);
+    void setBody(const VBytes& bytes) { setBody(bytes.data(), bytes.size()); }
+    void setFile(int new_fd, uint64_t new_offset = 0, uint64_t length = UINT64_MAX);
+    void setShared(const CFileCache::TFileRef& file);
+    void setStream(std::function<size_t(char* buf, size_t size)> new_stream);
+    void clear();
+    static const char* standardReason(int status);
   };
 
 private:
 
   // -------------------------------------------------------
+  // Select is rebuilt on each wait. Epoll keeps the sockets registered
+  // between calls, so add/remove must be called when sockets come and go
+  // Sockets are waited for writing instead of reading while watched for
+  // writing, and not waited for at all while not watched for reading
   struct TActivity {
+    bool     use_epoll = false;
+#if HTTP_HAS_EPOLL
+    int      epoll_fd = -1;
+    std::vector<epoll_event> events;
+#endif
     fd_set   fds;
+    fd_set   write_fds;
+    VSockets writers;
+    VSockets paused;
     VSockets ready_to_read;
+    VSockets ready_to_write;
+    bool open(bool new_use_epoll);
+    void close();
+    bool add(TSocket s);
+    void remove(TSocket s);
+    void watch(TSocket s, bool read, bool write);
     bool wait(VSockets& sockets, unsigned timeout_usecs);
   };
   
   // -------------------------------------------------------
-  bool    createServer(int port);
-  TSocket acceptNewClient();
-  void    prepare();
+  // Completion based engine. Defined in the .cpp
+  struct TURing;
+
+  // -------------------------------------------------------
+  // Bounded lock free queue. Multiple producers and consumers (D. Vyukov)
+  template< typename T >
+  class TQueue {
+    struct TCell {
+      std::atomic<size_t> seq;
+      T                   data;
+    };
+    TCell*              cells = nullptr;
+    size_t              mask = 0;
+    char                pad0[64];
+    std::atomic<size_t> tail;
+    char                pad1[64];
+    std::atomic<size_t> head;
+    char                pad2[64];
+  public:
+    TQueue() : tail(0), head(0) { }
+    ~TQueue() { delete[] cells; }
+    void init(size_t min_capacity) {
+      size_t capacity = 2;
+      while (capacity < min_capacity)
+        capacity <<= 1;
+      delete[] cells;
+      cells = new TCell[capacity];
+      mask = capacity - 1;
+      for (size_t i = 0; i < capacity; ++i)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+      tail.store(0);
+      head.store(0);
+    }
+    bool push(const T& value) {
+      if (!cells)
+        return false;
+      size_t pos = tail.load(std::memory_order_relaxed);
+      while (true) {
+        TCell* cell = &cells[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell->data = value;
+            cell->seq.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+          return false;       // Full
+        else
+          pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    bool pop(T& value) {
+      if (!cells)
+        return false;
+      size_t pos = head.load(std::memory_order_relaxed);
+      while (true) {
+        TCell* cell = &cells[pos & mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+          if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            value = cell->data;
+            cell->seq.store(pos + mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+          return false;       // Empty
+        else
+          pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    // Approximated while other threads are pushing or popping
+    size_t size() const {
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t h = head.load(std::memory_order_relaxed);
+      return t > h ? t - h : 0;
+    }
+  };
+
+  // -------------------------------------------------------
+  // A request handed to the workers. It owns a copy of the input,
+  // so it stays valid while the reactor keeps reading
+  struct TJob {
+    TRequest request;
+    VBytes   buf;
+    std::chrono::steady_clock::time_point queued_at;
+  };
+
+  // What the workers send back to the reactor owning the client
+  struct TAnswer {
+    TSocket  client;
+    VBytes   header;
+    VBytes   body;
+    int      file = -1;           // When set, the body is this range of the file
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    std::shared_ptr<const void> shared;   // When set, the body is shared_data, kept alive by it
+    const char* shared_data = nullptr;
+    TReactor* reactor = nullptr;  // Where it is posted
+    TJob*    done = nullptr;      // Set when the request has been fully handled
+    bool     keep = true;         // false to close the client after it
+  };
+
+  // -------------------------------------------------------
+  // Bytes or a range of a file not yet accepted by the kernel
+  struct TOutput {
+    VBytes       data;
+    int          file = -1;           // Sent with sendfile when set
+    std::shared_ptr<const void> shared;   // Or shared_data, kept alive by it (cached files...)
+    const char*  shared_data = nullptr;
+    uint64_t     offset = 0;
+    uint64_t     size = 0;
+  };
+
+  // Consumes the body of a request as it arrives, Content-Length or
+  // chunked. Without a job, the body is skipped
+  struct TInflateStream;
+
+  struct TBodyReader {
+    enum eState { DONE, DATA, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILERS };
+    eState       state = DONE;
+    bool         inflating = false;   // Content-Encoding gzip or deflate
+    uint64_t     remaining = 0;       // Of the content, or of the current chunk
+    uint64_t     received = 0;
+    std::unique_ptr<TJob> job;        // The request, until the body is complete
+  };
+
+  struct TConnection {
+    TSocket      socket;
+    bool         busy = false;        // A worker is handling a request from it
+    bool         closing = false;     // Close once the worker is done
+    int          nrequests = 0;
+    bool         close_when_sent = false;
+    std::vector<TOutput> output;      // Sent in order as the socket becomes writable
+    size_t       output_sent = 0;     // Bytes of the first one already sent
+    VBytes       partial;             // Received, but not yet handled
+    size_t       scanned = 0;         // Bytes of partial already searched for the end of a request
+    TBodyReader  body;
+    std::shared_ptr<TInflateStream> inflater;   // Created by the first compressed body, and reused
+    uint32_t     last_active = 0;     // In seconds
+    TConnection* prev = nullptr;      // Sorted by last_active, to find the idle ones
+    TConnection* next = nullptr;
+  };
+
+  // -------------------------------------------------------
+  // A listening socket and the clients accepted from it. Reactors
+  // share nothing, and each one is only used from the thread ticking it
+  struct TReactor {
+    CBaseServer* owner = nullptr;
+    TSocket      server;
+    VSockets     active_sockets;
+    VBytes       inbuf;
+    TActivity    activity;
+    TURing*      uring = nullptr;
+    std::thread  thread;
+    std::unordered_map<TSocket, TConnection> connections;
+    TConnection* oldest = nullptr;
+    TConnection* newest = nullptr;
+    uint32_t     now = 0;
+
+    // Answers from the workers, and how they wake us up. An eventfd, a
+    // pipe, or a pair of connected sockets in windows
+    TQueue<TAnswer*>    answers;
+    std::vector<TJob*>  parked;   // Waiting for room in the jobs queue
+    TSocket      wake_fds[2] = { INVALID_SOCKET, INVALID_SOCKET };
+
+    bool    open(CBaseServer* new_owner, int port, bool reuse_port);
+    void    close();
+    bool    tick(unsigned timeout_usecs);
+    bool    send(TSocket s, VBytes& header, const char* body, size_t body_size);
+    bool    sendNow(TSocket s, VBytes& header, const char* body, size_t body_size);
+    bool    send(TSocket s, VBytes& header, const VBytes& body) { return send(s, header, body.data(), body.size()); }
+    bool    sendNow(TSocket s, VBytes& header, const VBytes& body) { return sendNow(s, header, body.data(), body.size()); }
+    bool    sendFile(TSocket s, VBytes& header, int file, uint64_t offset, uint64_t size);
+    bool    sendFileNow(TSocket s, VBytes& header, int file, uint64_t offset, uint64_t size);
+    bool    sendShared(TSocket s, VBytes& header, const std::shared_ptr<const void>& keep, const char* data, size_t size);
+    bool    sendSharedNow(TSocket s, VBytes& header, const std::shared_ptr<const void>& keep, const char* data, size_t size);
+    void    queueOutput(TConnection& c, const char* data, size_t size);
+    void    flushOutput(TSocket s);
+    void    dropOutput(TConnection& c);
+    void    addClient(TSocket s);
+    TSocket acceptNewClient();
+    void    closeClient(TSocket s);
+    bool    processInput(TSocket s, char* data, size_t size);
+    bool    handleRequest(TSocket s, TConnection& c, char* data, size_t size);
+    bool    startBody(TSocket s, TConnection& c, TRequest& r, TJob* job);
+    bool    readBody(TSocket s, TConnection& c, const char* data, size_t size, size_t& used);
+    void    rejectBody(TSocket s, TRequest& r);
+    bool    rejectRequest(TSocket s, TRequest& r);
+    bool    deliverBody(TSocket s, TConnection& c, TRequest& r, const char* data, size_t size);
+    bool    runJob(TSocket s, TConnection& c, TJob* job);
+    void    watchRead(TSocket s, TConnection& c);
+    void    post(TAnswer* answer);
+    void    hold(TAnswer* answer);
+    void    wake();
+    void    drainAnswers();
+    void    updateClock();
+    void    touch(TConnection& c);
+    void    unlink(TConnection& c);
+    void    closeIdleClients();
+
+  private:
+    bool    createServer(int port, bool reuse_port);
+    bool    createWakeUp();
+    bool    prepare();
+    bool    dispatch(TJob* job);
+  };
+
+  // -------------------------
+  std::vector<TReactor*> reactors;
+  std::atomic<bool>      running;
 
   // -------------------------
-  TSocket   server;
-  VSockets  active_sockets;
-  VBytes    inbuf;
-  TActivity activity;
+  std::vector<std::thread> workers;
+  std::atomic<bool>        workers_running;
+  std::atomic<bool>        stopping;        // close() has been called. The workers quit
+  TQueue<TJob*>            jobs;
+  TQueue<TJob*>            free_jobs;
+  TQueue<TAnswer*>         free_answers;
+  std::mutex               workers_mutex;
+  std::condition_variable  workers_cv;
+  std::atomic<int>         workers_sleeping;
+  std::atomic<uint64_t>    stats_requests;
+  std::atomic<uint64_t>    stats_total_wait_usecs;
+  std::atomic<uint64_t>    stats_max_wait_usecs;
+  std::atomic<size_t>      stats_max_queue_depth;
+  void     runWorker();
+  TJob*    newJob();
+  TAnswer* newAnswer();
+  void     freeJob(TJob* job);
+  void     freeAnswer(TAnswer* answer);
+  void     dropAnswer(TAnswer* answer);
+  static TAnswer*& heldAnswer();
+  bool     callHandler(TRequest& r);
+  std::atomic<size_t>      stats_arena_max_used;
+  std::atomic<uint64_t>    stats_arena_overflows;
+  void     formatHeader(VBytes& header, const TRequest& r, TStringView status, uint64_t content_length, const char* content_type, TStringView extra_headers);
+  bool     sendStream(const TRequest& r, TStringView status, const TResponse& response);
+  bool     sendCompressedChunks(const TRequest& r, const VBytes& answer_data, const char* content_type, const char* encoding, int level, TStringView identity_headers, TStringView more_headers);
+  bool     sendBytes(const TRequest& r, const char* data, size_t size, const char* content_type, const char* content_encoding, TStringView more_headers);
+  // Extra header lines built on the stack, with the ETag and Last-Modified. Defined in the .cpp
+  struct   TExtraHeaders;
+  bool     sendNotModified(const TRequest& r, const TExtraHeaders& validators, bool& sent);
+  int      compressionLevel(const VBytes& answer_data, const char* content_type) const;
 
 protected:
   
-  void sendAnswer( 
+  // Return false when the client is not reading fast enough. The rest of
+  // the answer is queued, and no more requests are read from the client
+  // until it has been sent. From the workers the answer is always queued
+  bool sendAnswer( 
       const TRequest&   r
     , const VBytes& answer_data
     , const char* content_type
     , const char* content_encoding = nullptr    // gzip, deflate, br or null
     );
 
+  // Same for bytes you own, like a TArenaBytes
+  bool sendAnswer( 
+      const TRequest&   r
+    , const char* data
+    , size_t size
+    , const char* content_type
+    , const char* content_encoding = nullptr
+    );
+
+  // Any status, headers and body. Returns false like sendAnswer, and
+  // also when the file of the body can't be read. Then nothing is sent
+  bool sendResponse( 
+      const TRequest&   r
+    , const TResponse& response
+    );
+
   // Will try to compress your answer automatically if the client suppots compression
-  void compressAndSendAnswer( 
+  bool compressAndSendAnswer( 
       const TRequest&   r
     , const VBytes& answer_data
     , const char* content_type
     );
 
+  // Sends the file, or length bytes of it from offset as a 206 range,
+  // straight from the page cache. Returns false like sendAnswer, and
+  // also when the file can't be read or the range is outside it. Then
+  // nothing is sent
+  bool sendFileAnswer( 
+      const TRequest&   r
+    , const char* filename
+    , const char* content_type
+    , uint64_t offset = 0
+    , uint64_t length = UINT64_MAX
+    );
+
+  // Same with a file you opened. It is not closed
+  bool sendFileAnswer( 
+      const TRequest&   r
+    , int fd
+    , const char* content_type
+    , uint64_t offset = 0
+    , uint64_t length = UINT64_MAX
+    );
+
+  // Answers with a file from files, without copying it. Files too large
+  // for the cache are sent with sendFileAnswer. Returns false like
+  // sendFileAnswer
+  bool sendCachedFileAnswer( 
+      const TRequest&   r
+    , const char* filename
+    , const char* content_type
+    );
+
+  bool sendAnswer( 
+      const TRequest&   r
+    , const CFileCache::TFileRef& file
+    , const char* content_type
+    , const char* content_encoding = nullptr
+    );
+
 public:
 
+  // How the server waits for activity in the sockets. Read at open()
+  // Default is epoll when available, select otherwise
+  // io_uring requires linux 6.0, and falls back to the default when missing
+  enum eEngine { ENGINE_DEFAULT, ENGINE_SELECT, ENGINE_EPOLL, ENGINE_IO_URING };
+  eEngine engine = ENGINE_DEFAULT;
+
+  // Threads running onClientRequest, so slow requests don't stall the
+  // reactors. 0 runs it inside tick. Read at open()
+  int num_workers = 0;
+  int max_queued_requests = 1024;
+
+  // Clients sending longer requests are disconnected
+  size_t max_request_size = 16 * 1024;
+
+  // Longer bodies are answered with a 413 and the client disconnected.
+  // For compressed bodies, this is the size once inflated
+  uint64_t max_body_size = 64 * 1024 * 1024;
+
+  // Used by sendCachedFileAnswer
+  CFileCache files;
+
+  // Used by compressAndSendAnswer. Set compressed.max_bytes to enable it
+  CCompressedCache compressed;
+
+  // Without the cache, larger answers are compressed and sent in chunks
+  size_t stream_compression_min_size = 256 * 1024;
+
+  // Which answers compressAndSendAnswer compresses, and how hard.
+  // Types match by prefix, so 'video/' skips all the videos
+  struct TCompressionPolicy {
+    size_t min_size = 1024;             // Smaller answers are sent as they are
+    std::vector<std::string> skip_types = {
+      "image/png", "image/jpeg", "image/gif", "image/webp", "image/avif",
+      "audio/", "video/", "font/woff",
+      "application/gzip", "application/x-gzip", "application/zip", "application/zstd",
+    };
+    int level = 6;                      // 1 fastest .. 9 smallest
+    std::vector<std::pair<std::string, int>> type_levels;   // First match wins over level
+    // With this many requests waiting for the workers, use busy_level. 0 disables it
+    size_t busy_queue_depth = 64;
+    int    busy_level = 1;
+  };
+  TCompressionPolicy compression;
+
+  // Persistent connections. Return true from onClientRequest to keep them
+  unsigned keep_alive_timeout_secs = 10;
+  int      max_requests_per_connection = 1000;
+
+  struct TWorkerStats {
+    uint64_t requests;            // Handled by the workers
+    uint64_t avg_wait_usecs;      // Time in the queue before a worker takes them
+    uint64_t max_wait_usecs;
+    size_t   queue_depth;         // Now
+    size_t   max_queue_depth;
+  };
+  TWorkerStats getWorkerStats() const;
+
+  // Size of the blocks of r.arena. Tune it with the stats, so most
+  // requests fit in one
+  size_t arena_block_size = 16 * 1024;
+  struct TArenaStats {
+    size_t   max_used;            // The most any request has used
+    uint64_t overflows;           // Requests which needed more than one block
+  };
+  TArenaStats getArenaStats() const;
+
+  // Return false to close the connection after the answer. The header
+  // of the answer is written when it is sent, so set r.keep_alive to false
+  // before sending it to tell the client too.
+  // With several threads, this is called from all of them
   virtual bool onClientRequest(const TRequest& r) = 0;
+
+  // Receives the body of POST, PUT... requests in pieces as they arrive,
+  // before onClientRequest. Runs in the reactors, also with workers.
+  // Bodies sent with Content-Encoding gzip or deflate arrive inflated.
+  // Bodies sent with a GET are skipped. Return false to close the client
+  virtual bool onClientBody(const TRequest& /*r*/, const char* /*data*/, size_t /*size*/) { return true; }
+  CBaseServer();
   virtual ~CBaseServer();
 
-  bool open(int port);
+  // With nthreads > 1, each thread runs its own reactor listening in
+  // the same port (SO_REUSEPORT), and tick is no longer required.
+  // Call close before destroying your derived class to stop them
+  bool open(int port, int nthreads = 1);
   void close();
 
   // This will block for timeout_usecs at most. 0 just to poll